@@ -1,7 +1,7 @@
 require("redis.core")
 
-local clients = setmetatable({}, {__mode = "v"})
-local clientsnum = 0
+-- The module keeps track of live clients, subscribers and consumers itself,
+-- redis.GetClientsTable, GetSubscribersTable and GetConsumersTable return a snapshot of them
 local redisCreateClient = redis.CreateClient
 
 function redis.CreateClient()
@@ -10,25 +10,9 @@ function redis.CreateClient()
 		error(err)
 	end
 
-	table.insert(clients, client)
-	clientsnum = clientsnum + 1
 	return client
 end
 
-function redis.GetClientsTable()
-	for i = 1, clientsnum do
-		if clients[i] == nil then
-			table.remove(clients, i)
-			i = i - 1
-			clientsnum = clientsnum - 1
-		end
-	end
-
-	return clients
-end
-
-local subscribers = setmetatable({}, {__mode = "v"})
-local subscribersnum = 0
 local redisCreateSubscriber = redis.CreateSubscriber
 
 function redis.CreateSubscriber()
@@ -37,29 +21,22 @@ function redis.CreateSubscriber()
 		error(err)
 	end
 
-	table.insert(subscribers, subscriber)
-	subscribersnum = subscribersnum + 1
 	return subscriber
 end
 
-function redis.GetSubscribersTable()
-	for i = 1, subscribersnum do
-		if subscribers[i] == nil then
-			table.remove(subscribers, i)
-			i = i - 1
-			subscribersnum = subscribersnum - 1
-		end
+local redisCreateConsumer = redis.CreateConsumer
+
+function redis.CreateConsumer()
+	local consumer, err = redisCreateConsumer()
+	if not consumer then
+		error(err)
 	end
 
-	return subscribers
+	return consumer
 end
 
 local meta = FindMetaTable("redis_client")
 
-function meta:Auth(password, callback)
-	return self:Send({"AUTH", password}, callback)
-end
-
 function meta:State(callback)
 	return self:Send({"CLUSTER", "INFO"}, callback)
 end
@@ -72,52 +49,6 @@ function meta:LastSave(callback)
 	return self:Send("LASTSAVE", callback)
 end
 
-function meta:Expire(key, secs, callback)
-	return self:Send({"EXPIRE", key, secs}, callback)
-end
-
-function meta:Set(key, value, callback)
-	return self:Send({"SET", key, value}, callback)
-end
-
-function meta:SetEx(key, secs, value, callback)
-	return self:Send({"SETEX", key, secs, value}, callback)
-end
-
-function meta:Get(key, callback)
-	return self:Send({"GET", key}, callback)
-end
-
-function meta:Exists(key, callback)
-	local cmd = {"EXISTS"}
-	if type(key) == "table" then
-		for i = 1, #key do
-			cmd[i + 1] = key[i]
-		end
-	else
-		table.insert(cmd, key)
-	end
-
-	return self:Send(cmd, callback)
-end
-
-function meta:Delete(key, callback)
-	local cmd = {"DEL"}
-	if type(key) == "table" then
-		for i = 1, #key do
-			cmd[i + 1] = key[i]
-		end
-	else
-		table.insert(cmd, key)
-	end
-
-	return self:Send(cmd, callback)
-end
-
-function meta:Publish(channel, message, callback)
-	return self:Send({"PUBLISH", channel, message}, callback)
-end
-
 function meta:GetConfig(param, callback)
 	return self:Send({"CONFIG", "GET", param}, callback)
 end
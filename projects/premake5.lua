@@ -4,6 +4,17 @@ newoption({
 	value = "path to garrysmod_common directory"
 })
 
+newoption({
+	trigger = "openssl",
+	description = "Enables TLS support (redis client SetTLS) by linking against OpenSSL",
+	value = "path to OpenSSL directory"
+})
+
+newoption({
+	trigger = "io_uring",
+	description = "Adds the io_uring socket backend (redis.UseIOUring) on Linux, needs kernel 5.19 or newer to enable"
+})
+
 local gmcommon = _OPTIONS.gmcommon or os.getenv("GARRYSMOD_COMMON")
 if gmcommon == nil then
 	error("you didn't provide a path to your garrysmod_common (https://github.com/danielga/garrysmod_common) directory")
@@ -20,6 +31,27 @@ CreateWorkspace({name = "redis.core"})
 		includedirs({REDIS_FOLDER .. "/includes", TACOPIE_FOLDER .. "/includes"})
 		IncludeLuaShared()
 
+		if _OPTIONS.openssl then
+			defines("REDIS_TLS")
+			includedirs(_OPTIONS.openssl .. "/include")
+			libdirs(_OPTIONS.openssl .. "/lib")
+
+			filter("system:windows")
+				links({"libssl", "libcrypto"})
+
+			filter("system:not windows")
+				links({"ssl", "crypto"})
+
+			filter({})
+		end
+
+		if _OPTIONS.io_uring then
+			filter("system:linux")
+				defines("REDIS_IO_URING")
+
+			filter({})
+		end
+
 		filter("system:windows")
 			links("ws2_32")
 
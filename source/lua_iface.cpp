@@ -2,20 +2,37 @@
 #include "lua_iface.h"
 #include "redis_client.h"
 #include "redis_subscriber.h"
+#include "redis_consumer.h"
+#include "redis_uring.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// How long closing the module waits for replies to what was already sent
+static uint32_t shutdownTimeoutMs = 3000;
 
 GMOD_MODULE_OPEN()
 {
 	redis::lua::Initialize(LUA);
 	redis::client::Initialize(LUA);
 	redis::subscriber::Initialize(LUA);
+	redis::consumer::Initialize(LUA);
 
 	return 0;
 }
 
 GMOD_MODULE_CLOSE()
 {
+	redis::lua::Shutdown(LUA);
+
 	LUA->ReferenceFree(redis::globals::iRefDebugTraceBack);
 	LUA->ReferenceFree(redis::globals::iRefErrorNoHalt);
+	LUA->ReferenceFree(redis::globals::iRefInterfaces);
+
+	// Interfaces still alive are collected after this, their __gc must not touch the freed slot
+	redis::globals::iRefInterfaces = 0;
+
+	redis::uring::Shutdown();
 
 	return 0;
 }
@@ -30,20 +47,289 @@ static void redis::lua::Initialize(GarrysMod::Lua::ILuaBase* LUA)
 	redis::globals::iRefDebugTraceBack = LUA->ReferenceCreate();
 	LUA->Pop();
 
+	LUA->CreateTable();
+	LUA->CreateTable();
+	LUA->PushString("v");
+	LUA->SetField(-2, "__mode");
+	LUA->SetMetaTable(-2);
+	redis::globals::iRefInterfaces = LUA->ReferenceCreate();
+
 	LUA->CreateTable();
 
 	LUA->PushNumber(MODULE_VERSION);
 	LUA->SetField(-2, "Version");
 
+	LUA->PushNumber(static_cast<double>(replyShape::Array));
+	LUA->SetField(-2, "REPLY_ARRAY");
+
+	LUA->PushNumber(static_cast<double>(replyShape::Map));
+	LUA->SetField(-2, "REPLY_MAP");
+
+	LUA->PushNumber(static_cast<double>(replyShape::Scores));
+	LUA->SetField(-2, "REPLY_SCORES");
+
+	LUA->PushNumber(static_cast<double>(replyShape::Packed));
+	LUA->SetField(-2, "REPLY_PACKED");
+
+	// Send only, picks the shape from the command
+	LUA->PushNumber(-1);
+	LUA->SetField(-2, "REPLY_AUTO");
+
 	LUA->PushCFunction(wrap(redis::lua::Create<redis::client>));
 	LUA->SetField(-2, "CreateClient");
 
 	LUA->PushCFunction(wrap(redis::lua::Create<redis::subscriber>));
 	LUA->SetField(-2, "CreateSubscriber");
 
+	LUA->PushCFunction(wrap(redis::lua::Create<redis::consumer>));
+	LUA->SetField(-2, "CreateConsumer");
+
+	LUA->PushCFunction(wrap(redis::lua::KeySlot));
+	LUA->SetField(-2, "KeySlot");
+
+	LUA->PushCFunction(wrap(redis::lua::PollAll));
+	LUA->SetField(-2, "PollAll");
+
+	LUA->PushCFunction(wrap(redis::lua::GetInterfaces<redis::interfaceKind::Client>));
+	LUA->SetField(-2, "GetClientsTable");
+
+	LUA->PushCFunction(wrap(redis::lua::GetInterfaces<redis::interfaceKind::Subscriber>));
+	LUA->SetField(-2, "GetSubscribersTable");
+
+	LUA->PushCFunction(wrap(redis::lua::GetInterfaces<redis::interfaceKind::Consumer>));
+	LUA->SetField(-2, "GetConsumersTable");
+
+	LUA->PushCFunction(wrap(redis::lua::GetStats));
+	LUA->SetField(-2, "GetStats");
+
+	LUA->PushCFunction(wrap(redis::lua::SetShutdownTimeout));
+	LUA->SetField(-2, "SetShutdownTimeout");
+
+	LUA->PushCFunction(wrap(redis::lua::UseIOUring));
+	LUA->SetField(-2, "UseIOUring");
+
 	LUA->SetField(GarrysMod::Lua::INDEX_GLOBAL, "redis");
 }
 
+// https://redis.io/commands/cluster-keyslot/, computed locally
+static int redis::lua::KeySlot(GarrysMod::Lua::ILuaBase* LUA)
+{
+	LUA->CheckString(1);
+
+	size_t len;
+	const char* key = LUA->GetString(1, &len);
+
+	LUA->PushNumber(redis::KeySlot(std::string(key, len)));
+	return 1;
+}
+
+// PollAll(budgetMs), polls every client, subscriber and consumer that has something waiting
+// A tick with nothing to do costs one atomic load. Once budgetMs has passed the rest wait for the next call
+// Returns true if any of them handled something, like Poll
+static int redis::lua::PollAll(GarrysMod::Lua::ILuaBase* LUA)
+{
+	double budgetMs = -1;
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Number))
+		budgetMs = LUA->GetNumber(1);
+
+	// Not static, a callback may call PollAll again
+	std::vector<uint32_t> ready;
+	if (!redis::TakeReady(ready))
+	{
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	bool hadResponses = false;
+
+	size_t polled = 0;
+	for (; polled < ready.size(); polled++)
+	{
+		if (budgetMs >= 0 && polled > 0 && std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() >= budgetMs)
+			break;
+
+		hadResponses = Poll(LUA, ready[polled]) || hadResponses;
+	}
+
+	// Still marked, so nothing else re-adds them
+	for (size_t i = polled; i < ready.size(); i++)
+		redis::MarkReady(ready[i]);
+
+	LUA->PushBool(hadResponses);
+	return 1;
+}
+
+// Calls the Poll method of the interface with this id, as its callbacks expect
+// Returns false if it was collected or destroyed since
+static bool redis::lua::Poll(GarrysMod::Lua::ILuaBase* LUA, uint32_t id)
+{
+	LUA->ReferencePush(redis::globals::iRefInterfaces);
+	LUA->PushNumber(id);
+	LUA->GetTable(-2);
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::NIL))
+	{
+		LUA->Pop(2);
+		return false;
+	}
+
+	bool hadResponses = false;
+
+	LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+	LUA->GetField(-2, "Poll");
+	LUA->Push(-3);
+	if (LUA->PCall(1, 1, -3) != 0)
+		redis::ErrorNoHalt(LUA, "[redis Poll error] ");
+	else
+	{
+		hadResponses = LUA->GetBool(-1);
+		LUA->Pop();
+	}
+
+	LUA->Pop(3);
+	return hadResponses;
+}
+
+// Commits every live interface and keeps polling until what they sent is answered, or the shutdown timeout passes
+// Callbacks run as they would from Poll, anything they send is waited on as well
+static void redis::lua::Shutdown(GarrysMod::Lua::ILuaBase* LUA)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(shutdownTimeoutMs);
+
+	// Polls can destroy interfaces, so they're visited by id
+	std::vector<uint32_t> ids;
+	auto drain = [&ids]()
+		{
+			bool drained = true;
+			ids.clear();
+
+			for (auto kind : { redis::interfaceKind::Client, redis::interfaceKind::Subscriber, redis::interfaceKind::Consumer })
+				for (redis::registered* iface = redis::registered::First(kind); iface != nullptr; iface = iface->Next())
+				{
+					drained = iface->Drain() && drained;
+					ids.push_back(iface->Id());
+				}
+
+			return drained;
+		};
+
+	for (;;)
+	{
+		bool drained = drain();
+
+		for (uint32_t id : ids)
+			Poll(LUA, id);
+
+		// Only done if the callbacks that Poll just ran didn't send anything more
+		if (drained && drain())
+			break;
+
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			if (shutdownTimeoutMs == 0)
+				break;
+
+			LUA->PushString("Gave up waiting for replies after the shutdown timeout, see redis.SetShutdownTimeout");
+			redis::ErrorNoHalt(LUA, "[redis] ");
+			break;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Whatever is still held for a reconnect gets its callback with an error
+	ids.clear();
+	for (auto kind : { redis::interfaceKind::Client, redis::interfaceKind::Subscriber, redis::interfaceKind::Consumer })
+		for (redis::registered* iface = redis::registered::First(kind); iface != nullptr; iface = iface->Next())
+		{
+			iface->Abandon();
+			ids.push_back(iface->Id());
+		}
+
+	for (uint32_t id : ids)
+		Poll(LUA, id);
+}
+
+// SetShutdownTimeout(ms), how long closing the module waits for replies to commands already sent, 0 doesn't wait
+static int redis::lua::SetShutdownTimeout(GarrysMod::Lua::ILuaBase* LUA)
+{
+	shutdownTimeoutMs = static_cast<uint32_t>(std::max(0.0, LUA->CheckNumber(1)));
+	return 0;
+}
+
+// GetStats(), {clients = n, subscribers = n, consumers = n, connected = n} for the live interfaces
+static int redis::lua::GetStats(GarrysMod::Lua::ILuaBase* LUA)
+{
+	size_t connected = 0;
+	for (auto kind : { redis::interfaceKind::Client, redis::interfaceKind::Subscriber, redis::interfaceKind::Consumer })
+		for (const redis::registered* iface = redis::registered::First(kind); iface != nullptr; iface = iface->Next())
+			if (iface->IsConnected())
+				connected++;
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(static_cast<double>(redis::registered::Count(redis::interfaceKind::Client)));
+	LUA->SetField(-2, "clients");
+
+	LUA->PushNumber(static_cast<double>(redis::registered::Count(redis::interfaceKind::Subscriber)));
+	LUA->SetField(-2, "subscribers");
+
+	LUA->PushNumber(static_cast<double>(redis::registered::Count(redis::interfaceKind::Consumer)));
+	LUA->SetField(-2, "consumers");
+
+	LUA->PushNumber(static_cast<double>(connected));
+	LUA->SetField(-2, "connected");
+
+	return 1;
+}
+
+// GetClientsTable(), GetSubscribersTable() and GetConsumersTable(), a new array of the live ones in creation order
+template <redis::interfaceKind kind>
+static int redis::lua::GetInterfaces(GarrysMod::Lua::ILuaBase* LUA)
+{
+	LUA->CreateTable();
+
+	double index = 1;
+	for (const redis::registered* iface = redis::registered::First(kind); iface != nullptr; iface = iface->Next())
+	{
+		LUA->PushNumber(index);
+		iface->PushObject(LUA);
+
+		// Unreachable and waiting for its __gc
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::NIL))
+		{
+			LUA->Pop(2);
+			continue;
+		}
+
+		LUA->SetTable(-3);
+		index++;
+	}
+
+	return 1;
+}
+
+// UseIOUring(enabled), clients created afterwards do their socket I/O through one shared io_uring
+// Returns nil and an error if the module was built without it or the kernel can't provide it
+static int redis::lua::UseIOUring(GarrysMod::Lua::ILuaBase* LUA)
+{
+	LUA->CheckType(1, GarrysMod::Lua::Type::Bool);
+
+	try
+	{
+		redis::uring::SetEnabled(LUA->GetBool(1));
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		LUA->PushNil();
+		LUA->PushString(e.what());
+		return 2;
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
 template <class T>
 static int redis::lua::Create(GarrysMod::Lua::ILuaBase* LUA)
 {
@@ -5,6 +5,16 @@ namespace redis
 	namespace lua
 	{
 		static void Initialize(GarrysMod::Lua::ILuaBase* LUA);
+		static int KeySlot(GarrysMod::Lua::ILuaBase* LUA);
+		static int PollAll(GarrysMod::Lua::ILuaBase* LUA);
+		static bool Poll(GarrysMod::Lua::ILuaBase* LUA, uint32_t id);
+		static void Shutdown(GarrysMod::Lua::ILuaBase* LUA);
+		static int SetShutdownTimeout(GarrysMod::Lua::ILuaBase* LUA);
+		static int GetStats(GarrysMod::Lua::ILuaBase* LUA);
+
+		template <redis::interfaceKind kind>
+		static int GetInterfaces(GarrysMod::Lua::ILuaBase* LUA);
+		static int UseIOUring(GarrysMod::Lua::ILuaBase* LUA);
 
 		template <class T>
 		static int Create(GarrysMod::Lua::ILuaBase* LUA);
@@ -8,6 +8,7 @@ namespace redis
 	{
 		extern int				iRefErrorNoHalt = 0;
 		extern int				iRefDebugTraceBack = 0;
+		extern int				iRefInterfaces = 0;
 	}
 
 	bool PushCallback(GarrysMod::Lua::ILuaBase* LUA, int ref, int idx, const char* field)
@@ -5,7 +5,14 @@
 #include <cpp_redis/cpp_redis>
 #include <GarrysMod/Lua/Interface.h>
 #include "readerwriterqueue.hpp"
+#include "redis_transport.h"
+#include "redis_reconnect.h"
+#include "redis_registry.h"
+#include <atomic>
 #include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #define DerivedInterfaceMethod(ret) template <class actionStruct, class redisInterface> ret redis::BaseInterface<actionStruct, redisInterface>
 #define wrap(Fn) [](lua_State* L) -> int { GarrysMod::Lua::ILuaBase* LUA = L->luabase; LUA->SetState(L); return Fn(LUA); }
@@ -16,6 +23,7 @@ namespace redis
 	{
 		extern int			iRefErrorNoHalt;
 		extern int			iRefDebugTraceBack;
+		extern int			iRefInterfaces;	// Weak, interface id to its Lua object
 
 		enum class actionType
 		{
@@ -23,7 +31,8 @@ namespace redis
 			Disconnection,
 			Reply,
 			Publish,
-			Message
+			Message,
+			Page
 		};
 	}
 
@@ -34,12 +43,16 @@ namespace redis
 	struct action {
 		globals::actionType	type;
 		actionData	data;
+		connectionEvent	event;	// Connection and Disconnection
 	};
 
 	template <class actionStruct, class redisInterface>
-	class BaseInterface {
+	class BaseInterface : public registered {
 	public:
-		BaseInterface(GarrysMod::Lua::ILuaBase* LUA);
+		BaseInterface(GarrysMod::Lua::ILuaBase* LUA, interfaceKind kind);
+		virtual ~BaseInterface() = default;
+
+		bool IsConnected() const override { return m_iface.is_connected(); }
 
 		static int lua__eq(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua__tostring(GarrysMod::Lua::ILuaBase* LUA);
@@ -54,8 +67,13 @@ namespace redis
 		static int lua_Disconnect(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_Poll(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_Commit(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetTLS(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetReconnect(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetWriteCoalescing(GarrysMod::Lua::ILuaBase* LUA);
 
-		bool EnqueueAction(const actionStruct& action) { return m_queue.enqueue(action); }
+		// The network, reconnect and Lua threads all queue actions, the queue itself only takes one producer
+		bool EnqueueAction(const actionStruct& action) { bool queued; { std::lock_guard<std::mutex> lock(m_enqueueMutex); queued = m_queue.enqueue(action); } Wake(); return queued; }
+		bool EnqueueAction(actionStruct&& action) { bool queued; { std::lock_guard<std::mutex> lock(m_enqueueMutex); queued = m_queue.enqueue(std::move(action)); } Wake(); return queued; }
 		bool DequeueAction(actionStruct& action) { return m_queue.try_dequeue(action); }
 	protected:
 		inline static int	m_metaTableID = 0;
@@ -64,21 +82,57 @@ namespace redis
 		int					m_refOnDisconnected = 0;
 		int					m_refOnMessage = 0;
 
+		// Where the last Connect went, for connections opened alongside m_iface
+		std::string			m_host;
+		size_t				m_port = 0;
+		int					m_timeoutMs = 0;
+
 		static BaseInterface* Get(GarrysMod::Lua::ILuaBase* LUA, int index, bool throwNullError) { return static_cast<BaseInterface*>(_get(LUA, index, throwNullError)); }
 		static void* _get(GarrysMod::Lua::ILuaBase* LUA, int index, bool throwNullError);
 
 		static void InitMetatable(GarrysMod::Lua::ILuaBase* LUA, const char* mtName);
 		static void CheckType(GarrysMod::Lua::ILuaBase* LUA, int index);
-		virtual void HandleAction(GarrysMod::Lua::ILuaBase* LUA, actionStruct action) { }
-
+		virtual void HandleAction(GarrysMod::Lua::ILuaBase* LUA, actionStruct& action) { }
+		// Frees every Lua reference held by the interface before it is deleted
+		virtual void ReleaseReferences(GarrysMod::Lua::ILuaBase* LUA);
+		// Runs before the queue is drained, returns true if anything was dispatched
+		virtual bool PollPending(GarrysMod::Lua::ILuaBase* LUA) { return false; }
+		// Runs before OnConnected and OnDisconnected
+		virtual void ConnectionChanged(GarrysMod::Lua::ILuaBase* LUA, bool connected, const connectionEvent& event) { }
+		// Whether Poll has to come back without anything queued, like for timeouts
+		virtual bool NeedsPoll() const { return false; }
+
+		// Drain for interfaces built on cpp_redis::client: commits what's buffered followed by a PING,
+		// done once that is answered with nothing sent since
+		bool DrainCommands();
+
+		// Marks the interface for PollAll, once until its next Poll
+		void Wake() { if (!m_ready.exchange(true)) MarkReady(Id()); }
+
+		// Connects m_iface to m_host, throws cpp_redis::redis_error
+		void Connect();
+		bool Reconnect();
+		void PushEvent(globals::actionType type, const connectionEvent& event);
+
+		std::shared_ptr<transport> m_transport;
 		redisInterface m_iface;
+		std::mutex m_enqueueMutex;
 		moodycamel::ReaderWriterQueue<actionStruct> m_queue;
+		reconnector m_reconnect;
+
+		std::atomic<bool> m_ready{ false };
+
+		bool m_drainSent = false;
+		std::atomic<bool> m_drainAnswered{ false };
+		uint64_t m_drainWrites = 0;
 	};
 };
 
 
 #pragma region BaseInterface
-DerivedInterfaceMethod()::BaseInterface(GarrysMod::Lua::ILuaBase* LUA)
+DerivedInterfaceMethod()::BaseInterface(GarrysMod::Lua::ILuaBase* LUA, interfaceKind kind)
+	: registered(kind), m_transport(std::make_shared<transport>()), m_iface(m_transport),
+	m_reconnect([this] { return Reconnect(); }, [this](const connectionEvent& event) { PushEvent(globals::actionType::Disconnection, event); })
 {
 	LUA->PushUserType(this, m_metaTableID);
 	LUA->PushMetaTable(m_metaTableID);
@@ -86,6 +140,13 @@ DerivedInterfaceMethod()::BaseInterface(GarrysMod::Lua::ILuaBase* LUA)
 
 	LUA->CreateTable();
 	LUA->SetFEnv(-2);
+
+	// PollAll finds the object again through its id, weakly so it still gets collected
+	LUA->ReferencePush(globals::iRefInterfaces);
+	LUA->PushNumber(Id());
+	LUA->Push(-3);
+	LUA->SetTable(-3);
+	LUA->Pop();
 }
 
 DerivedInterfaceMethod(void)::InitMetatable(GarrysMod::Lua::ILuaBase* LUA, const char* mtName)
@@ -131,6 +192,15 @@ DerivedInterfaceMethod(void)::InitMetatable(GarrysMod::Lua::ILuaBase* LUA, const
 
 	LUA->PushCFunction(wrap(lua_Commit));
 	LUA->SetField(-2, "Commit");
+
+	LUA->PushCFunction(wrap(lua_SetTLS));
+	LUA->SetField(-2, "SetTLS");
+
+	LUA->PushCFunction(wrap(lua_SetReconnect));
+	LUA->SetField(-2, "SetReconnect");
+
+	LUA->PushCFunction(wrap(lua_SetWriteCoalescing));
+	LUA->SetField(-2, "SetWriteCoalescing");
 }
 
 DerivedInterfaceMethod(void*)::_get(GarrysMod::Lua::ILuaBase* LUA, int index, bool throwNullError)
@@ -225,13 +295,33 @@ DerivedInterfaceMethod(int)::lua__gc(GarrysMod::Lua::ILuaBase* LUA)
 {
 	BaseInterface* ptr = Get(LUA, 1, false);
 
-	if (ptr != nullptr)
-		delete ptr,
-		LUA->SetUserType(1, nullptr);
+	if (ptr == nullptr)
+		return 0;
+
+	// Gone already when collected after the module closed
+	if (globals::iRefInterfaces != 0)
+		LUA->ReferencePush(globals::iRefInterfaces),
+		LUA->PushNumber(ptr->Id()),
+		LUA->PushNil(),
+		LUA->SetTable(-3),
+		LUA->Pop();
+
+	ptr->m_reconnect.Stop();
+	ptr->ReleaseReferences(LUA);
+	delete ptr;
+	LUA->SetUserType(1, nullptr);
 
 	return 0;
 }
 
+DerivedInterfaceMethod(void)::ReleaseReferences(GarrysMod::Lua::ILuaBase* LUA)
+{
+	for (int* ref : { &m_refOnConnected, &m_refOnDisconnected, &m_refOnMessage })
+		if (*ref > 0)
+			LUA->ReferenceFree(*ref),
+			*ref = 0;
+}
+
 DerivedInterfaceMethod(int)::lua_IsValid(GarrysMod::Lua::ILuaBase* LUA)
 {
 	BaseInterface* ptr = Get(LUA, 1, false);
@@ -252,7 +342,7 @@ DerivedInterfaceMethod(int)::lua_IsReconnecting(GarrysMod::Lua::ILuaBase* LUA)
 {
 	BaseInterface* ptr = Get(LUA, 1, true);
 
-	LUA->PushBool(ptr->m_iface.is_reconnecting());
+	LUA->PushBool(ptr->m_reconnect.Pending());
 	return 1;
 }
 
@@ -260,38 +350,48 @@ DerivedInterfaceMethod(int)::lua_Connect(GarrysMod::Lua::ILuaBase* LUA)
 {
 	BaseInterface* ptr = Get(LUA, 1, true);
 
-	const char* host = LUA->CheckString(2);
-	size_t port = static_cast<size_t>(LUA->CheckNumber(3));
+	std::string host = LUA->CheckString(2);
+	size_t port = 0;
+
+	// unix:/path/to/redis.sock, tacopie opens a unix domain socket when the port is 0
+	if (host.compare(0, 5, "unix:") == 0)
+	{
+#ifdef _WIN32
+		LUA->PushNil();
+		LUA->PushString("Unix sockets are not supported on Windows");
+		return 2;
+#else
+		host.erase(0, 5);
+		if (host.empty())
+			LUA->ArgError(2, "expected a socket path after unix:");
+#endif
+	}
+	else
+		port = static_cast<size_t>(LUA->CheckNumber(3));
 
 	int timeoutMs = 250;
 	if (LUA->IsType(4, GarrysMod::Lua::Type::Number))
 		timeoutMs = LUA->GetNumber(4);
 
-	int maxReconnects = -1;
+	ptr->m_reconnect.Cancel();
+
+	// Only override SetReconnect when given, the interval is the first backoff step
+	reconnectPolicy policy = ptr->m_reconnect.GetPolicy();
 	if (LUA->IsType(5, GarrysMod::Lua::Type::Number))
-		maxReconnects = LUA->GetNumber(5);
+		policy.maxAttempts = static_cast<int32_t>(LUA->GetNumber(5));
 
-	int reconnectIntervalMs = 250;
 	if (LUA->IsType(6, GarrysMod::Lua::Type::Number))
-		reconnectIntervalMs = LUA->GetNumber(6);
+		policy.baseMs = static_cast<uint32_t>(LUA->GetNumber(6));
+
+	ptr->m_reconnect.SetPolicy(policy);
+
+	ptr->m_host = host;
+	ptr->m_port = port;
+	ptr->m_timeoutMs = timeoutMs;
 
 	try
 	{
-		ptr->m_iface.connect(host, port, [ptr](auto, auto, auto status)
-			{
-				using state = cpp_redis::connect_state;
-
-				if (
-					status == state::dropped ||
-					status == state::failed ||
-					status == state::lookup_failed ||
-					status == state::stopped
-					)
-					ptr->EnqueueAction({ globals::actionType::Disconnection });
-				else if (status == state::ok)
-					ptr->EnqueueAction({ globals::actionType::Connection });
-
-			}, timeoutMs, maxReconnects, reconnectIntervalMs);
+		ptr->Connect();
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -304,10 +404,98 @@ DerivedInterfaceMethod(int)::lua_Connect(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
+DerivedInterfaceMethod(void)::Connect()
+{
+	// cpp_redis doesn't reconnect by itself, m_reconnect does with backoff
+	m_iface.connect(m_host, m_port, [this](auto, auto, auto status)
+		{
+			using state = cpp_redis::connect_state;
+
+			if (status == state::dropped)
+				PushEvent(globals::actionType::Disconnection, m_reconnect.Schedule());
+			else if (status == state::ok)
+			{
+				// Cleared first, Poll replays held commands as soon as it sees the event
+				connectionEvent event;
+				event.attempt = m_reconnect.Connected();
+				PushEvent(globals::actionType::Connection, event);
+			}
+
+		}, m_timeoutMs, 0, 0);
+}
+
+DerivedInterfaceMethod(bool)::Reconnect()
+{
+	// Whatever was sent since the drop fails now, so replies line up with the new connection
+	try
+	{
+		m_iface.commit();
+	}
+	catch (const cpp_redis::redis_error&) { }
+
+	try
+	{
+		Connect();
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+DerivedInterfaceMethod(bool)::DrainCommands()
+{
+	if (!m_iface.is_connected())
+		return true;
+
+	if (m_drainSent)
+	{
+		if (!m_drainAnswered)
+			return false;
+
+		if (m_transport->Writes() == m_drainWrites)
+			return true;
+	}
+
+	// Replies come back in order, so the PING's means everything before it was answered
+	// A dropped connection fails it too, which also ends the wait
+	m_drainSent = true;
+	m_drainAnswered = false;
+
+	try
+	{
+		m_iface.send({ "PING" }, [this](cpp_redis::reply&)
+			{
+				m_drainAnswered = true;
+				Wake();
+			});
+
+		m_iface.commit();
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		return true;
+	}
+
+	m_transport->FlushWrites();
+	m_drainWrites = m_transport->Writes();
+	return false;
+}
+
+DerivedInterfaceMethod(void)::PushEvent(globals::actionType type, const connectionEvent& event)
+{
+	actionStruct action{ type };
+	action.event = event;
+	EnqueueAction(std::move(action));
+}
+
 DerivedInterfaceMethod(int)::lua_Disconnect(GarrysMod::Lua::ILuaBase* LUA)
 {
 	BaseInterface* ptr = Get(LUA, 1, true);
 
+	ptr->m_reconnect.Cancel();
 	ptr->m_iface.disconnect();
 	return 0;
 }
@@ -316,11 +504,21 @@ DerivedInterfaceMethod(int)::lua_Commit(GarrysMod::Lua::ILuaBase* LUA)
 {
 	BaseInterface* ptr = Get(LUA, 1, true);
 
+	// Held writes go out at the end of the next Poll
+	ptr->Wake();
+
 	try {
 		ptr->m_iface.commit();
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
+		// Held commands go out once reconnected
+		if (ptr->m_reconnect.Pending() && ptr->m_reconnect.GetPolicy().hold)
+		{
+			LUA->PushBool(true);
+			return 1;
+		}
+
 		LUA->PushNil();
 		LUA->PushString(e.what());
 		return 2;
@@ -330,11 +528,103 @@ DerivedInterfaceMethod(int)::lua_Commit(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
+// SetTLS(true or {ca = path, cert = path, key = path, servername = name, verify = bool} or false)
+// Used from the next Connect on, sessions are resumed when the same host is connected again
+DerivedInterfaceMethod(int)::lua_SetTLS(GarrysMod::Lua::ILuaBase* LUA)
+{
+	BaseInterface* ptr = Get(LUA, 1, true);
+
+	try
+	{
+		if (LUA->IsType(2, GarrysMod::Lua::Type::Table))
+		{
+			tlsOptions options;
+			for (auto field : { std::make_pair("ca", &options.caFile), std::make_pair("cert", &options.certFile), std::make_pair("key", &options.keyFile), std::make_pair("servername", &options.serverName) })
+			{
+				LUA->GetField(2, field.first);
+				if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+					*field.second = LUA->GetString(-1);
+
+				LUA->Pop();
+			}
+
+			LUA->GetField(2, "verify");
+			if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+				options.verify = LUA->GetBool(-1);
+
+			LUA->Pop();
+
+			ptr->m_transport->EnableTLS(options);
+		}
+		else if (LUA->GetBool(2))
+			ptr->m_transport->EnableTLS(tlsOptions());
+		else
+			ptr->m_transport->DisableTLS();
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		LUA->PushNil();
+		LUA->PushString(e.what());
+		return 2;
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// SetReconnect({base = ms, max = ms, attempts = n, hold = bool, maxHeld = n})
+// Retries wait base * 2^attempt ms, capped at max, with up to half of it taken off at random.
+// attempts = -1 retries forever. While reconnecting, commands are held and sent once connected
+// (up to maxHeld of them), or fail right away with hold = false.
+DerivedInterfaceMethod(int)::lua_SetReconnect(GarrysMod::Lua::ILuaBase* LUA)
+{
+	BaseInterface* ptr = Get(LUA, 1, true);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Table);
+
+	reconnectPolicy policy = ptr->m_reconnect.GetPolicy();
+
+	auto number = [LUA](const char* field, auto& value)
+		{
+			LUA->GetField(2, field);
+			if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+				value = static_cast<std::remove_reference_t<decltype(value)>>(LUA->GetNumber(-1));
+
+			LUA->Pop();
+		};
+
+	number("base", policy.baseMs);
+	number("max", policy.maxMs);
+	number("attempts", policy.maxAttempts);
+	number("maxHeld", policy.maxHeld);
+
+	LUA->GetField(2, "hold");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+		policy.hold = LUA->GetBool(-1);
+
+	LUA->Pop();
+
+	ptr->m_reconnect.SetPolicy(policy);
+	return 0;
+}
+
+// Commits are held and written together at the end of the next Poll, so a tick costs one write instead of one per Commit
+DerivedInterfaceMethod(int)::lua_SetWriteCoalescing(GarrysMod::Lua::ILuaBase* LUA)
+{
+	BaseInterface* ptr = Get(LUA, 1, true);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Bool);
+
+	ptr->m_transport->SetWriteCoalescing(LUA->GetBool(2));
+	return 0;
+}
+
 DerivedInterfaceMethod(int)::lua_Poll(GarrysMod::Lua::ILuaBase* LUA)
 {
 	BaseInterface* ptr = Get(LUA, 1, true);
 
-	bool hadResponses = false;
+	// Anything queued from here on marks it again
+	ptr->m_ready = false;
+
+	bool hadResponses = ptr->PollPending(LUA);
 	actionStruct action;
 	while (ptr->DequeueAction(action))
 	{
@@ -343,33 +633,60 @@ DerivedInterfaceMethod(int)::lua_Poll(GarrysMod::Lua::ILuaBase* LUA)
 		switch (action.type)
 		{
 		case globals::actionType::Disconnection:
+		{
+			const connectionEvent& event = action.event;
+			ptr->ConnectionChanged(LUA, false, event);
+
+			// OnDisconnected(self, attempt, retryIn) with retryIn in seconds, nil once it gave up
 			LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
 			if (redis::PushCallback(LUA, ptr->m_refOnDisconnected, 1, "OnDisconnected"))
 			{
 				LUA->Push(1);
-				if (LUA->PCall(1, 0, -3) != 0)
+				LUA->PushNumber(event.attempt);
+
+				if (event.retryInMs >= 0)
+					LUA->PushNumber(event.retryInMs / 1000.0);
+				else
+					LUA->PushNil();
+
+				if (LUA->PCall(3, 0, -5) != 0)
 					redis::ErrorNoHalt(LUA, "[redis OnDisconnected callback error] ");
 			}
-			else
-				LUA->Pop();
+
+			LUA->Pop();
 			break;
+		}
 		case globals::actionType::Connection:
+		{
+			const connectionEvent& event = action.event;
+			ptr->ConnectionChanged(LUA, true, event);
+
+			// OnConnected(self, attempts) where attempts is 0 for Connect
 			LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
-			if (redis::PushCallback(LUA, ptr->m_refOnDisconnected, 1, "OnConnected"))
+			if (redis::PushCallback(LUA, ptr->m_refOnConnected, 1, "OnConnected"))
 			{
 				LUA->Push(1);
-				if (LUA->PCall(1, 0, -3) != 0)
+				LUA->PushNumber(event.attempt);
+
+				if (LUA->PCall(2, 0, -4) != 0)
 					redis::ErrorNoHalt(LUA, "[redis OnConnected callback error] ");
 			}
-			else
-				LUA->Pop();
+
+			LUA->Pop();
 			break;
+		}
 		default:
 			ptr->HandleAction(LUA, action);
 			break;
 		}
 	}
 
+	// Includes whatever the callbacks above committed
+	ptr->m_transport->FlushWrites();
+
+	if (ptr->NeedsPoll())
+		ptr->Wake();
+
 	LUA->PushBool(hadResponses);
 	return 1;
 }
@@ -1,5 +1,25 @@
 #include "main.hpp"
 #include "redis_client.h"
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_set>
+
+redis::client::client(GarrysMod::Lua::ILuaBase* LUA) : BaseInterface(LUA, interfaceKind::Client)
+{
+	m_transport->SetNativeReplies(true);
+	m_transport->SetPushHandler([this](resp::frame&& frame)
+		{
+			clientAction action = { redis::globals::actionType::Message };
+			action.data.native = std::move(frame);
+			EnqueueAction(std::move(action));
+		});
+}
+
+redis::client::~client()
+{
+	m_transport->SetPushHandler(nullptr);
+	m_iface.disconnect(true);
+}
 
 void redis::client::Initialize(GarrysMod::Lua::ILuaBase* LUA)
 {
@@ -7,6 +27,31 @@ void redis::client::Initialize(GarrysMod::Lua::ILuaBase* LUA)
 
 	LUA->PushCFunction(wrap(lua_Send));
 	LUA->SetField(-2, "Send");
+	LUA->PushCFunction(wrap(lua_SetCoalescing));
+	LUA->SetField(-2, "SetCoalescing");
+	LUA->PushCFunction(wrap(lua_SetPageLimit));
+	LUA->SetField(-2, "SetPageLimit");
+	LUA->PushCFunction(wrap(lua_SetTimeout));
+	LUA->SetField(-2, "SetTimeout");
+	LUA->PushCFunction(wrap(lua_SetCompression));
+	LUA->SetField(-2, "SetCompression");
+	LUA->PushCFunction(wrap(lua_SetNativeReplies));
+	LUA->SetField(-2, "SetNativeReplies");
+	LUA->PushCFunction(wrap(lua_SetProtocol));
+	LUA->SetField(-2, "SetProtocol");
+
+	LUA->PushCFunction(wrap(lua_Scan));
+	LUA->SetField(-2, "Scan");
+	LUA->PushCFunction(wrap(lua_HScan));
+	LUA->SetField(-2, "HScan");
+	LUA->PushCFunction(wrap(lua_SScan));
+	LUA->SetField(-2, "SScan");
+	LUA->PushCFunction(wrap(lua_ZScan));
+	LUA->SetField(-2, "ZScan");
+	LUA->PushCFunction(wrap(lua_GetChunked));
+	LUA->SetField(-2, "GetChunked");
+	LUA->PushCFunction(wrap(lua_GetRangeChunked));
+	LUA->SetField(-2, "GetRangeChunked");
 
 	LUA->PushCFunction(wrap(lua_Ping));
 	LUA->SetField(-2, "Ping");
@@ -16,6 +61,8 @@ void redis::client::Initialize(GarrysMod::Lua::ILuaBase* LUA)
 	LUA->SetField(-2, "Select");
 	LUA->PushCFunction(wrap(lua_Publish));
 	LUA->SetField(-2, "Publish");
+	LUA->PushCFunction(wrap(lua_SPublish));
+	LUA->SetField(-2, "SPublish");
 
 	LUA->PushCFunction(wrap(lua_Exists));
 	LUA->SetField(-2, "Exists");
@@ -30,6 +77,29 @@ void redis::client::Initialize(GarrysMod::Lua::ILuaBase* LUA)
 	LUA->SetField(-2, "SetEx");
 	LUA->PushCFunction(wrap(lua_TTL));
 	LUA->SetField(-2, "TTL");
+	LUA->PushCFunction(wrap(lua_Expire));
+	LUA->SetField(-2, "Expire");
+	LUA->PushCFunction(wrap(lua_Incr));
+	LUA->SetField(-2, "Incr");
+	LUA->PushCFunction(wrap(lua_IncrBy));
+	LUA->SetField(-2, "IncrBy");
+
+	LUA->PushCFunction(wrap(lua_MGet));
+	LUA->SetField(-2, "MGet");
+	LUA->PushCFunction(wrap(lua_MSet));
+	LUA->SetField(-2, "MSet");
+
+	LUA->PushCFunction(wrap(lua_HMGet));
+	LUA->SetField(-2, "HMGet");
+	LUA->PushCFunction(wrap(lua_HSet));
+	LUA->SetField(-2, "HSet");
+	LUA->PushCFunction(wrap(lua_HGetAll));
+	LUA->SetField(-2, "HGetAll");
+
+	LUA->PushCFunction(wrap(lua_SetTable));
+	LUA->SetField(-2, "SetTable");
+	LUA->PushCFunction(wrap(lua_GetTable));
+	LUA->SetField(-2, "GetTable");
 
 	LUA->Pop();
 }
@@ -39,32 +109,153 @@ void buildTable(GarrysMod::Lua::ILuaBase* LUA, const std::vector<cpp_redis::repl
 	LUA->CreateTable();
 
 	int i = 1;
-	for (auto reply : replies)
+	for (const cpp_redis::reply& reply : replies)
 	{
 		LUA->PushNumber(i++);
+		redis::client::PushReply(LUA, reply);
+		LUA->SetTable(-3);
+	}
+}
+
+// Flat field/value replies become {field = value}, missing values are left out
+void buildMap(GarrysMod::Lua::ILuaBase* LUA, const std::vector<cpp_redis::reply>& replies)
+{
+	LUA->CreateTable();
+
+	for (size_t i = 0; i + 1 < replies.size(); i += 2)
+	{
+		if (replies[i + 1].is_null())
+			continue;
+
+		redis::client::PushReply(LUA, replies[i]);
+		redis::client::PushReply(LUA, replies[i + 1]);
+		LUA->SetTable(-3);
+	}
+}
+
+// Member/score replies become {member = score} with numeric scores
+void buildScores(GarrysMod::Lua::ILuaBase* LUA, const std::vector<cpp_redis::reply>& replies)
+{
+	LUA->CreateTable();
+
+	for (size_t i = 0; i + 1 < replies.size(); i += 2)
+	{
+		if (!replies[i].is_string() || !replies[i + 1].is_string())
+			continue;
+
+		const std::string& member = replies[i].as_string();
+		LUA->PushString(member.c_str(), member.size());
+		LUA->PushNumber(std::strtod(replies[i + 1].as_string().c_str(), nullptr));
+		LUA->SetTable(-3);
+	}
+}
+
+static bool IsText(const redis::resp::node& value)
+{
+	return value.type == redis::resp::nodeType::Bulk || value.type == redis::resp::nodeType::Simple || value.type == redis::resp::nodeType::Double;
+}
+
+// Pushes a value of a frame parsed by the transport, shaped the same way PushReply shapes a cpp_redis::reply
+static void PushNode(GarrysMod::Lua::ILuaBase* LUA, const redis::resp::frame& frame, size_t& index, replyShape shape = replyShape::Array)
+{
+	using redis::resp::nodeType;
+
+	const redis::resp::node& value = frame.nodes[index++];
+	switch (value.type)
+	{
+	case nodeType::Simple:
+	case nodeType::Error:
+	case nodeType::Bulk:
+	case nodeType::BigNumber:
+		LUA->PushString(frame.At(value), value.size);
+		break;
+
+	case nodeType::Double:
+		// The \r after it ends the number
+		LUA->PushNumber(std::strtod(frame.At(value), nullptr));
+		break;
+
+	case nodeType::Integer:
+		LUA->PushNumber(static_cast<double>(value.integer));
+		break;
+
+	case nodeType::Boolean:
+		LUA->PushBool(value.boolean);
+		break;
+
+	case nodeType::Null:
+		LUA->PushNil();
+		break;
+
+	case nodeType::Attribute:
+		for (size_t i = 0; i < static_cast<size_t>(value.size) * 2; ++i)
+			index = redis::resp::Skip(frame.nodes, index);
+
+		PushNode(LUA, frame, index, shape);
+		break;
+
+	default:
+	{
+		LUA->CreateTable();
 
-		switch (reply.get_type())
+		bool pairs = value.type == nodeType::Map || shape == replyShape::Map || shape == replyShape::Scores;
+		if (!pairs)
 		{
-		case cpp_redis::reply::type::error:
-		case cpp_redis::reply::type::bulk_string:
-		case cpp_redis::reply::type::simple_string:
-			LUA->PushString(reply.as_string().c_str());
+			for (uint32_t i = 1; i <= value.size; ++i)
+			{
+				LUA->PushNumber(i);
+				PushNode(LUA, frame, index);
+				LUA->SetTable(-3);
+			}
 			break;
+		}
 
-		case cpp_redis::reply::type::integer:
-			LUA->PushNumber(static_cast<double>(reply.as_integer()));
-			break;
+		// RESP3 sends the pairs of arrays such as ZRANGE WITHSCORES as arrays of their own
+		bool nested = value.type != nodeType::Map && value.size > 0 && frame.nodes[index].type == nodeType::Array && frame.nodes[index].size == 2;
 
-		case cpp_redis::reply::type::array:
-			buildTable(LUA, reply.as_array());
-			break;
+		size_t count = value.type == nodeType::Map || nested ? value.size : value.size / 2;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (nested)
+			{
+				const redis::resp::node& pair = frame.nodes[index];
+				if (pair.type != nodeType::Array || pair.size != 2)
+				{
+					index = redis::resp::Skip(frame.nodes, index);
+					continue;
+				}
 
-		case cpp_redis::reply::type::null:
-			LUA->PushNil();
-			break;
+				++index;
+			}
+
+			const redis::resp::node& field = frame.nodes[index];
+			const redis::resp::node& fieldValue = frame.nodes[redis::resp::Skip(frame.nodes, index)];
+
+			// Missing values are left out, and scores need both as text
+			bool skip = field.type == nodeType::Null || fieldValue.type == nodeType::Null;
+			if (shape == replyShape::Scores)
+				skip = !IsText(field) || !IsText(fieldValue);
+
+			if (skip)
+			{
+				index = redis::resp::Skip(frame.nodes, redis::resp::Skip(frame.nodes, index));
+				continue;
+			}
+
+			PushNode(LUA, frame, index);
+			if (shape == replyShape::Scores)
+				LUA->PushNumber(std::strtod(frame.At(frame.nodes[index++]), nullptr));
+			else
+				PushNode(LUA, frame, index);
+
+			LUA->SetTable(-3);
 		}
 
-		LUA->SetTable(-3);
+		// An odd element of a flat map has no value
+		if (value.type != nodeType::Map && !nested && value.size % 2 != 0)
+			index = redis::resp::Skip(frame.nodes, index);
+		break;
+	}
 	}
 }
 
@@ -74,7 +265,7 @@ const char* toString(GarrysMod::Lua::ILuaBase* LUA, int32_t idx, size_t* len = n
 		switch (LUA->GetType(idx))
 		{
 		case GarrysMod::Lua::Type::NUMBER:
-			LUA->PushFormattedString("%f", LUA->GetNumber(idx));
+			LUA->PushFormattedString("%.14g", LUA->GetNumber(idx));
 			break;
 
 		case GarrysMod::Lua::Type::STRING:
@@ -97,43 +288,358 @@ const char* toString(GarrysMod::Lua::ILuaBase* LUA, int32_t idx, size_t* len = n
 	return LUA->GetString(-1, len);
 }
 
-void redis::client::HandleAction(GarrysMod::Lua::ILuaBase* LUA, clientAction action)
+void redis::client::PushReply(GarrysMod::Lua::ILuaBase* LUA, const cpp_redis::reply& reply, replyShape shape)
 {
-	if (action.type == redis::globals::actionType::Reply)
+	switch (reply.get_type())
 	{
-		if (action.data.reference > 0)
+	case cpp_redis::reply::type::error:
+	case cpp_redis::reply::type::bulk_string:
+	case cpp_redis::reply::type::simple_string:
+		LUA->PushString(reply.as_string().c_str(), reply.as_string().size());
+		break;
+
+	case cpp_redis::reply::type::integer:
+		LUA->PushNumber(static_cast<double>(reply.as_integer()));
+		break;
+
+	case cpp_redis::reply::type::array:
+		switch (shape)
 		{
-			LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
-			LUA->ReferencePush(action.data.reference);
-			LUA->Push(1);
+		case replyShape::Map:
+			buildMap(LUA, reply.as_array());
+			break;
 
-			switch (action.data.reply.get_type())
-			{
-			case cpp_redis::reply::type::error:
-			case cpp_redis::reply::type::bulk_string:
-			case cpp_redis::reply::type::simple_string:
-				LUA->PushString(action.data.reply.as_string().c_str());
-				break;
+		case replyShape::Scores:
+			buildScores(LUA, reply.as_array());
+			break;
 
-			case cpp_redis::reply::type::integer:
-				LUA->PushNumber(static_cast<double>(action.data.reply.as_integer()));
-				break;
+		default:
+			buildTable(LUA, reply.as_array());
+			break;
+		}
+		break;
 
-			case cpp_redis::reply::type::array:
-				buildTable(LUA, action.data.reply.as_array());
-				break;
+	case cpp_redis::reply::type::null:
+		LUA->PushNil();
+		break;
+	}
+}
 
-			case cpp_redis::reply::type::null:
-				LUA->PushNil();
-				break;
+void redis::client::InvokeCallback(GarrysMod::Lua::ILuaBase* LUA, int reference, const cpp_redis::reply& reply, replyShape shape, const std::vector<msgpack::token>* unpacked, const resp::frame* native)
+{
+	LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+	LUA->ReferencePush(reference);
+	LUA->Push(1);
+
+	// callback(self, value, err), an error reply only ever fills err so callbacks can branch on it
+	int args = 2;
+	if (native != nullptr && !native->nodes.empty())
+	{
+		const resp::node& root = native->nodes[0];
+		if (root.type == resp::nodeType::Error)
+		{
+			LUA->PushNil();
+			LUA->PushString(native->At(root), root.size);
+			args = 3;
+		}
+		else
+		{
+			size_t index = 0;
+			PushNode(LUA, *native, index, shape);
+		}
+	}
+	else if (reply.is_error())
+	{
+		LUA->PushNil();
+		LUA->PushString(reply.as_string().c_str(), reply.as_string().size());
+		args = 3;
+	}
+	else if (unpacked != nullptr && !unpacked->empty())
+		msgpack::Push(LUA, reply.as_string(), *unpacked);
+	else
+		PushReply(LUA, reply, shape);
+
+	if (LUA->PCall(args, 0, -args - 2) != 0)
+		redis::ErrorNoHalt(LUA, "[redis Send callback error] ");
+
+	LUA->Pop();
+}
+
+bool redis::client::PollPending(GarrysMod::Lua::ILuaBase* LUA)
+{
+	m_pagesThisPoll = 0;
+
+	bool hadPages = ExpireDeadlines(LUA);
+	while (!m_deferredPages.empty() && m_pagesThisPoll < m_pageLimit)
+	{
+		clientAction action = std::move(m_deferredPages.front());
+		m_deferredPages.pop_front();
+
+		HandlePage(LUA, action);
+		hadPages = true;
+	}
+
+	return hadPages;
+}
+
+void redis::client::ConnectionChanged(GarrysMod::Lua::ILuaBase* LUA, bool connected, const redis::connectionEvent& event)
+{
+	// Still retrying
+	if (m_held.empty() || (!connected && event.retryInMs >= 0))
+		return;
+
+	std::deque<heldCommand> held = std::move(m_held);
+	m_held.clear();
+
+	std::string err = "Reconnecting failed";
+	if (connected)
+	{
+		try
+		{
+			// Their deadlines still count from when they were first sent
+			for (; !held.empty(); held.pop_front())
+				if (held.front().firstKey > 0)
+					DispatchKeyed(held.front().command, held.front().firstKey, held.front().reference, 0);
+				else
+					Dispatch(held.front().command, held.front().reference, held.front().shape, 0);
+
+			m_iface.commit();
+		}
+		catch (const cpp_redis::redis_error& e)
+		{
+			err = e.what();
+		}
+	}
+
+	cpp_redis::reply reply(err, cpp_redis::reply::string_type::error);
+	for (heldCommand& command : held)
+		if (command.reference > 0)
+		{
+			m_timed.erase(command.reference);
+			InvokeCallback(LUA, command.reference, reply, command.shape);
+			LUA->ReferenceFree(command.reference);
+		}
+}
+
+void redis::client::ReleaseReferences(GarrysMod::Lua::ILuaBase* LUA)
+{
+	BaseInterface::ReleaseReferences(LUA);
+
+	// Never sent, timed out with their reply still outstanding, or waiting on another request
+	for (heldCommand& command : m_held)
+		if (command.reference > 0)
+			LUA->ReferenceFree(command.reference);
+
+	for (int32_t reference : m_timedOut)
+		LUA->ReferenceFree(reference);
+
+	for (auto& coalesced : m_coalesced)
+		for (int32_t waiter : coalesced.second.waiters)
+			LUA->ReferenceFree(waiter);
+
+	m_held.clear();
+	m_timedOut.clear();
+	m_coalesced.clear();
+	m_inflightReads.clear();
+	m_timed.clear();
+	m_deadlines = decltype(m_deadlines)();
+}
+
+void redis::client::Abandon()
+{
+	if (m_held.empty())
+		return;
+
+	// Connected meanwhile, its Connection action replays them
+	m_reconnect.Cancel();
+	if (m_iface.is_connected())
+		return;
+
+	// Delivered by the last Poll as giving up on reconnecting, which fails them in ConnectionChanged
+	PushEvent(redis::globals::actionType::Disconnection, redis::connectionEvent());
+}
+
+std::vector<int32_t> redis::client::DetachWaiters(int32_t reference)
+{
+	std::vector<int32_t> waiters;
+	if (m_coalesced.empty())
+		return waiters;
+
+	auto coalesced = m_coalesced.find(reference);
+	if (coalesced == m_coalesced.end())
+		return waiters;
+
+	auto inflight = m_inflightReads.find(coalesced->second.command);
+	if (inflight != m_inflightReads.end() && inflight->second == reference)
+		m_inflightReads.erase(inflight);
+
+	waiters = std::move(coalesced->second.waiters);
+	m_coalesced.erase(coalesced);
+	return waiters;
+}
+
+void redis::client::Track(int callbackRef, int64_t timeoutMs)
+{
+	if (timeoutMs < 0)
+		timeoutMs = m_timeoutMs;
+
+	if (callbackRef <= 0 || timeoutMs == 0)
+		return;
+
+	uint64_t sequence = ++m_deadlineSequence;
+	m_deadlines.push({ std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs), callbackRef, sequence });
+	m_timed[callbackRef] = sequence;
+
+	// PollAll has to come back for the deadline even if no reply does
+	Wake();
+}
+
+bool redis::client::ExpireDeadlines(GarrysMod::Lua::ILuaBase* LUA)
+{
+	if (m_deadlines.empty())
+		return false;
+
+	bool expired = false;
+	auto now = std::chrono::steady_clock::now();
+	while (!m_deadlines.empty() && m_deadlines.top().at <= now)
+	{
+		deadline top = m_deadlines.top();
+		m_deadlines.pop();
+
+		// Answered in time, the reference may already belong to another request
+		auto timed = m_timed.find(top.reference);
+		if (timed == m_timed.end() || timed->second != top.sequence)
+			continue;
+
+		m_timed.erase(timed);
+		Expire(LUA, top.reference);
+		expired = true;
+	}
+
+	return expired;
+}
+
+void redis::client::Expire(GarrysMod::Lua::ILuaBase* LUA, int32_t reference)
+{
+	cpp_redis::reply reply("Timed out", cpp_redis::reply::string_type::error);
+
+	// Never sent, so no reply will come for it
+	for (auto held = m_held.begin(); held != m_held.end(); ++held)
+		if (held->reference == reference)
+		{
+			m_held.erase(held);
+			InvokeCallback(LUA, reference, reply, replyShape::Array);
+			LUA->ReferenceFree(reference);
+			return;
+		}
+
+	// The reference is kept until the reply shows up so it can't be handed to another request meanwhile
+	m_timedOut.insert(reference);
+
+	std::vector<int32_t> waiters = DetachWaiters(reference);
+
+	InvokeCallback(LUA, reference, reply, replyShape::Array);
+
+	for (int32_t waiter : waiters)
+	{
+		InvokeCallback(LUA, waiter, reply, replyShape::Array);
+		LUA->ReferenceFree(waiter);
+	}
+}
+
+void redis::client::HandleAction(GarrysMod::Lua::ILuaBase* LUA, clientAction& action)
+{
+	if (action.type == redis::globals::actionType::Page)
+	{
+		if (m_pagesThisPoll >= m_pageLimit || !m_deferredPages.empty())
+			m_deferredPages.push_back(std::move(action));
+		else
+			HandlePage(LUA, action);
+	}
+	else if (action.type == redis::globals::actionType::Message)
+		HandlePush(LUA, action);
+	else if (action.type == redis::globals::actionType::Reply)
+	{
+		if (action.data.reference > 0)
+		{
+			if (!m_timedOut.empty() && m_timedOut.erase(action.data.reference) != 0)
+			{
+				// Its callback already got a timeout error
+				LUA->ReferenceFree(action.data.reference);
+				return;
 			}
 
-			if (LUA->PCall(2, 0, -4) != 0)
-				redis::ErrorNoHalt(LUA, "[redis Send callback error] ");
+			if (!m_timed.empty())
+				m_timed.erase(action.data.reference);
 
+			// Detach before running any Lua so callbacks issuing the same read start a new request
+			std::vector<int32_t> waiters = DetachWaiters(action.data.reference);
+
+			InvokeCallback(LUA, action.data.reference, action.data.reply, action.data.shape, &action.data.unpacked, &action.data.native);
 			LUA->ReferenceFree(action.data.reference);
+
+			for (int32_t waiter : waiters)
+			{
+				InvokeCallback(LUA, waiter, action.data.reply, action.data.shape, &action.data.unpacked, &action.data.native);
+				LUA->ReferenceFree(waiter);
+			}
+		}
+
+		m_tokenPool.Give(std::move(action.data.unpacked));
+	}
+}
+
+void redis::client::HandlePush(GarrysMod::Lua::ILuaBase* LUA, clientAction& action)
+{
+	const resp::frame& frame = action.data.native;
+	if (frame.nodes.size() < 2 || !IsText(frame.nodes[1]))
+		return;
+
+	uint32_t size = frame.nodes[0].size;
+	std::string kind = frame.String(frame.nodes[1]);
+	size_t index = 2;
+
+	LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+
+	// OnMessage(self, channel, message, pattern) like a subscriber's
+	if (((kind == "message" || kind == "smessage") && size == 3) || (kind == "pmessage" && size == 4))
+	{
+		if (redis::PushCallback(LUA, m_refOnMessage, 1, "OnMessage"))
+		{
+			LUA->Push(1);
+
+			size_t pattern = 0;
+			if (kind == "pmessage")
+				pattern = index,
+				index = resp::Skip(frame.nodes, index);
+
+			PushNode(LUA, frame, index);
+			PushNode(LUA, frame, index);
+
+			if (pattern != 0)
+				PushNode(LUA, frame, pattern);
+			else
+				LUA->PushNil();
+
+			if (LUA->PCall(4, 0, -6) != 0)
+				redis::ErrorNoHalt(LUA, "[redis OnMessage callback error] ");
 		}
 	}
+	// OnPush(self, kind, ...) with the rest of the push, such as the keys of an "invalidate"
+	else if (redis::PushCallback(LUA, 0, 1, "OnPush"))
+	{
+		LUA->Push(1);
+		LUA->PushString(kind.c_str(), kind.size());
+
+		int args = 2;
+		for (uint32_t i = 1; i < size; ++i, ++args)
+			PushNode(LUA, frame, index);
+
+		if (LUA->PCall(args, 0, -args - 2) != 0)
+			redis::ErrorNoHalt(LUA, "[redis OnPush callback error] ");
+	}
+
+	LUA->Pop();
 }
 
 int redis::client::Exception(GarrysMod::Lua::ILuaBase* LUA, int callbackRef, const cpp_redis::redis_error& e)
@@ -192,23 +698,734 @@ std::vector<std::string> redis::client::GetKeys(GarrysMod::Lua::ILuaBase* LUA, i
 	return keys;
 }
 
-
-// Send commands directly
-int redis::client::lua_Send(GarrysMod::Lua::ILuaBase* LUA)
+
+static std::string ToUpper(const std::string& str)
+{
+	std::string upper(str);
+	std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+	return upper;
+}
+
+static bool IsReadOnly(const std::string& name)
+{
+	static const std::unordered_set<std::string> readOnly = {
+		"GET", "MGET", "GETRANGE", "STRLEN", "EXISTS", "TTL", "PTTL", "TYPE",
+		"HGET", "HMGET", "HGETALL", "HEXISTS", "HLEN", "HKEYS", "HVALS",
+		"LRANGE", "LLEN", "LINDEX", "SMEMBERS", "SISMEMBER", "SCARD",
+		"ZRANGE", "ZSCORE", "ZCARD", "ZRANK", "ZCOUNT"
+	};
+
+	return readOnly.find(ToUpper(name)) != readOnly.end();
+}
+
+replyShape redis::client::GetReplyShape(const std::vector<std::string>& command)
+{
+	if (command.empty())
+		return replyShape::Array;
+
+	std::string name = ToUpper(command[0]);
+	if (name == "HGETALL")
+		return replyShape::Map;
+
+	if (name == "CONFIG")
+		return command.size() > 1 && ToUpper(command[1]) == "GET" ? replyShape::Map : replyShape::Array;
+
+	if (name == "ZPOPMIN" || name == "ZPOPMAX")
+		return replyShape::Scores;
+
+	if ((name[0] == 'Z' && name.find("RANGE") != std::string::npos) || name == "ZRANDMEMBER" || name == "ZUNION" || name == "ZINTER" || name == "ZDIFF")
+		for (size_t i = command.size() - 1; i > 1; --i)
+			if (ToUpper(command[i]) == "WITHSCORES")
+				return replyShape::Scores;
+
+	if (name == "HRANDFIELD" && command.size() > 3 && ToUpper(command[3]) == "WITHVALUES")
+		return replyShape::Map;
+
+	return replyShape::Array;
+}
+
+// Decompresses tagged values in a reply on the network thread, including the elements of array replies
+// A value that only looks tagged but doesn't decompress is passed through as it is
+static void Inflate(cpp_redis::reply& reply)
+{
+	if (reply.is_bulk_string())
+	{
+		if (!redis::lz4::IsCompressed(reply.as_string()))
+			return;
+
+		try
+		{
+			reply = cpp_redis::reply(redis::lz4::Decompress(reply.as_string()), cpp_redis::reply::string_type::bulk_string);
+		}
+		catch (const std::runtime_error&) { }
+		return;
+	}
+
+	if (!reply.is_array())
+		return;
+
+	const std::vector<cpp_redis::reply>& elements = reply.as_array();
+	auto tagged = std::find_if(elements.begin(), elements.end(), [](const cpp_redis::reply& element)
+		{
+			return element.is_bulk_string() && redis::lz4::IsCompressed(element.as_string());
+		});
+
+	if (tagged == elements.end())
+		return;
+
+	std::vector<cpp_redis::reply> inflated = elements;
+	for (size_t i = tagged - elements.begin(); i < inflated.size(); ++i)
+		if (inflated[i].is_bulk_string())
+			Inflate(inflated[i]);
+
+	reply = cpp_redis::reply(inflated);
+}
+
+static void Inflate(redis::resp::frame& frame)
+{
+	for (redis::resp::node& value : frame.nodes)
+	{
+		if (value.type != redis::resp::nodeType::Bulk || !redis::lz4::IsCompressed(frame.At(value), value.size))
+			continue;
+
+		try
+		{
+			std::string inflated = redis::lz4::Decompress(frame.At(value), value.size);
+
+			// Strings only hold an offset, so they stay valid as data grows
+			value.offset = frame.data.size();
+			value.size = static_cast<uint32_t>(inflated.size());
+			frame.data.append(inflated);
+		}
+		catch (const std::runtime_error&) { }
+	}
+}
+
+void redis::client::Resolve(cpp_redis::reply& reply)
+{
+	resp::frame frame;
+	if (m_transport->ClaimFrame(reply, frame))
+		reply = resp::ToReply(frame);
+}
+
+static bool IsSubscription(const std::string& name)
+{
+	std::string upper = ToUpper(name);
+	return upper == "SUBSCRIBE" || upper == "UNSUBSCRIBE" || upper == "PSUBSCRIBE" || upper == "PUNSUBSCRIBE" || upper == "SSUBSCRIBE" || upper == "SUNSUBSCRIBE";
+}
+
+bool redis::client::Hold(const std::vector<std::string>& command, int callbackRef, replyShape shape, size_t firstKey, int64_t timeoutMs)
+{
+	if (!m_reconnect.Pending() && m_held.empty())
+		return false;
+
+	reconnectPolicy policy = m_reconnect.GetPolicy();
+	if (!policy.hold)
+		throw cpp_redis::redis_error("Not connected, reconnecting");
+
+	if (m_held.size() >= policy.maxHeld)
+		throw cpp_redis::redis_error("Too many commands held while reconnecting");
+
+	Track(callbackRef, timeoutMs);
+	m_held.push_back({ command, callbackRef, shape, firstKey });
+	return true;
+}
+
+void redis::client::Dispatch(const std::vector<std::string>& command, int callbackRef, replyShape shape, int64_t timeoutMs)
+{
+	// Every channel is confirmed separately, and only RESP3 can tell those confirmations from replies
+	if (!command.empty() && IsSubscription(command[0]))
+	{
+		if (m_transport->Protocol() != 3)
+			throw cpp_redis::redis_error("Subscribing on a client needs SetProtocol(3), or use a subscriber");
+
+		if (command.size() != 2)
+			throw cpp_redis::redis_error("Subscribe to one channel per command");
+	}
+
+	if (Hold(command, callbackRef, shape, 0, timeoutMs))
+		return;
+
+	if (callbackRef == GarrysMod::Lua::Type::NONE)
+	{
+		if (!m_inflightReads.empty())
+			m_inflightReads.clear();
+
+		m_iface.send(command);
+		return;
+	}
+
+	std::string key;
+	if (m_coalesce && !command.empty() && IsReadOnly(command[0]))
+	{
+		key.append(1, static_cast<char>(shape));
+		for (const std::string& arg : command)
+			key.append(std::to_string(arg.size())).append(1, ':').append(arg);
+
+		auto inflight = m_inflightReads.find(key);
+		// Waiters aren't tracked, they share the deadline of the request they joined and are resolved along with it
+		// A held command replayed into one drops the deadline it was given while held
+		if (inflight != m_inflightReads.end())
+		{
+			if (!m_timed.empty())
+				m_timed.erase(callbackRef);
+
+			m_coalesced[inflight->second].waiters.push_back(callbackRef);
+			return;
+		}
+	}
+	else if (!m_inflightReads.empty())
+		// Anything but a read may change what an in-flight read returns, so don't let later reads join it
+		m_inflightReads.clear();
+
+	Track(callbackRef, timeoutMs);
+
+	m_iface.send(command, [this, callbackRef, shape](cpp_redis::reply& reply)
+		{
+			clientAction action = { redis::globals::actionType::Reply, {cpp_redis::reply(), callbackRef, shape} };
+
+			if (m_transport->ClaimFrame(reply, action.data.native))
+				Inflate(action.data.native);
+			else
+			{
+				// cpp_redis is done with the reply once this returns, so it is moved rather than copied element by element
+				Inflate(reply);
+				action.data.reply = std::move(reply);
+			}
+
+			// Unpacked here so Lua only has to build the tables
+			const cpp_redis::reply& packed = action.data.reply;
+			if (shape == replyShape::Packed && packed.is_bulk_string())
+			{
+				try
+				{
+					action.data.unpacked = m_tokenPool.Take();
+					msgpack::Unpack(packed.as_string(), action.data.unpacked);
+				}
+				catch (const std::runtime_error& e)
+				{
+					action.data.reply = cpp_redis::reply(e.what(), cpp_redis::reply::string_type::error);
+				}
+			}
+
+			EnqueueAction(std::move(action));
+		});
+
+	if (!key.empty())
+	{
+		m_inflightReads.emplace(key, callbackRef);
+		m_coalesced[callbackRef].command = std::move(key);
+	}
+}
+
+void redis::client::DispatchKeyed(const std::vector<std::string>& command, size_t firstKey, int callbackRef, int64_t timeoutMs)
+{
+	if (Hold(command, callbackRef, replyShape::Array, firstKey, timeoutMs))
+		return;
+
+	if (!m_inflightReads.empty())
+		m_inflightReads.clear();
+
+	Track(callbackRef, timeoutMs);
+
+	std::vector<std::string> keys(command.begin() + firstKey, command.end());
+	m_iface.send(command, [this, callbackRef, keys](cpp_redis::reply& reply)
+		{
+			Resolve(reply);
+			Inflate(reply);
+
+			// Pair every value with the key it was requested by so it can be pushed as a map
+			if (reply.is_array())
+			{
+				const std::vector<cpp_redis::reply>& values = reply.as_array();
+
+				std::vector<cpp_redis::reply> pairs;
+				pairs.reserve(keys.size() * 2);
+				for (size_t i = 0; i < keys.size() && i < values.size(); ++i)
+				{
+					pairs.emplace_back(keys[i], cpp_redis::reply::string_type::bulk_string);
+					pairs.push_back(values[i]);
+				}
+
+				reply = cpp_redis::reply(pairs);
+			}
+
+			EnqueueAction({ redis::globals::actionType::Reply, {std::move(reply), callbackRef, replyShape::Map} });
+		});
+}
+
+int redis::client::GetTrailingCallback(GarrysMod::Lua::ILuaBase* LUA, int& lastArg)
+{
+	lastArg = LUA->Top();
+	if (!LUA->IsType(lastArg, GarrysMod::Lua::Type::FUNCTION))
+		return GarrysMod::Lua::Type::NONE;
+
+	LUA->Push(lastArg--);
+	return LUA->ReferenceCreate();
+}
+
+void redis::client::AppendArgs(GarrysMod::Lua::ILuaBase* LUA, int stackPos, int lastArg, std::vector<std::string>& command)
+{
+	size_t len;
+	for (int i = stackPos; i <= lastArg; ++i)
+	{
+		if (!LUA->IsType(i, GarrysMod::Lua::Type::TABLE))
+		{
+			const char* arg = toString(LUA, i, &len);
+			command.emplace_back(arg, len);
+			LUA->Pop();
+			continue;
+		}
+
+		for (int k = 1; ; ++k)
+		{
+			LUA->PushNumber(k);
+			LUA->GetTable(i);
+			if (LUA->IsType(-1, GarrysMod::Lua::Type::NIL))
+			{
+				LUA->Pop();
+				break;
+			}
+
+			const char* arg = toString(LUA, -1, &len);
+			command.emplace_back(arg, len);
+			LUA->Pop(2);
+		}
+	}
+}
+
+void redis::client::AppendPairs(GarrysMod::Lua::ILuaBase* LUA, int stackPos, std::vector<std::string>& command)
+{
+	size_t len;
+
+	LUA->PushNil();
+	while (LUA->Next(stackPos) != 0)
+	{
+		const char* field = toString(LUA, -2, &len);
+		command.emplace_back(field, len);
+		LUA->Pop();
+
+		const char* value = toString(LUA, -1, &len);
+		command.emplace_back(value, len);
+		LUA->Pop(2);
+	}
+}
+
+// Send commands directly
+// Replies are flat arrays unless a shape is given. With REPLY_AUTO, HGETALL, CONFIG GET and WITHSCORES replies are shaped into maps
+// Send(command, callback?, shape?, timeoutMs?) overrides SetTimeout for this command, 0 waits forever
+int redis::client::lua_Send(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	int shape = static_cast<int>(replyShape::Array);
+	if (LUA->IsType(4, GarrysMod::Lua::Type::NUMBER))
+	{
+		shape = static_cast<int>(LUA->GetNumber(4));
+		if (shape < -1 || shape > static_cast<int>(replyShape::Packed))
+			LUA->ArgError(4, "invalid reply shape");
+	}
+
+	int64_t timeoutMs = -1;
+	if (LUA->IsType(5, GarrysMod::Lua::Type::NUMBER))
+		timeoutMs = std::max<int64_t>(static_cast<int64_t>(LUA->GetNumber(5)), 0);
+
+	std::vector<std::string> keys = GetKeys(LUA, 2);
+	int callbackRef = GetCallbackOptional(LUA, 3);
+
+	try
+	{
+		ptr->Dispatch(keys, callbackRef, shape < 0 ? GetReplyShape(keys) : static_cast<replyShape>(shape), timeoutMs);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// Callbacks not answered within this many milliseconds get a "Timed out" error from Poll, 0 disables it
+// A reply arriving after that is dropped
+int redis::client::lua_SetTimeout(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	ptr->m_timeoutMs = static_cast<uint32_t>(std::max(LUA->CheckNumber(2), 0.0));
+	return 0;
+}
+
+std::string redis::client::PrepareValue(GarrysMod::Lua::ILuaBase* LUA, const char* value, size_t len, int compressArg) const
+{
+	bool compress = m_compress;
+	if (LUA->IsType(compressArg, GarrysMod::Lua::Type::BOOL))
+		compress = LUA->GetBool(compressArg);
+
+	std::string compressed;
+	if (compress && len >= m_compressThreshold && redis::lz4::Compress(value, len, compressed))
+		return compressed;
+
+	return std::string(value, len);
+}
+
+// SetCompression(enabled, threshold?), LZ4 compresses values written by Set, SetEx and SetTable that are at least threshold bytes
+// Compressed values are tagged and decompressed before they reach callbacks whether or not this is enabled
+int redis::client::lua_SetCompression(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+	LUA->CheckType(2, GarrysMod::Lua::Type::BOOL);
+
+	ptr->m_compress = LUA->GetBool(2);
+	if (LUA->IsType(3, GarrysMod::Lua::Type::NUMBER))
+		ptr->m_compressThreshold = static_cast<size_t>(std::max(LUA->GetNumber(3), 0.0));
+
+	return 0;
+}
+
+// Aggregate replies are parsed by the module instead of cpp_redis, on by default; takes effect on the next Connect
+int redis::client::lua_SetNativeReplies(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+	LUA->CheckType(2, GarrysMod::Lua::Type::BOOL);
+
+	ptr->m_transport->SetNativeReplies(LUA->GetBool(2));
+	return 0;
+}
+
+// SetProtocol(3) switches to RESP3 on the next Connect, replying with native maps, doubles and booleans
+// Pushes then arrive on this connection too, pub/sub messages in OnMessage and the rest, such as invalidations, in OnPush
+int redis::client::lua_SetProtocol(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	int version = static_cast<int>(LUA->CheckNumber(2));
+	if (version != 2 && version != 3)
+		LUA->ArgError(2, "protocol must be 2 or 3");
+
+	ptr->m_transport->SetProtocol(version);
+	return 0;
+}
+
+// Identical reads issued while one is still in flight share its reply
+int redis::client::lua_SetCoalescing(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+	LUA->CheckType(2, GarrysMod::Lua::Type::BOOL);
+
+	ptr->m_coalesce = LUA->GetBool(2);
+	if (!ptr->m_coalesce)
+		ptr->m_inflightReads.clear();
+
+	return 0;
+}
+
+// https://redis.io/commands/ping/
+int redis::client::lua_Ping(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	int callbackRef = GetCallbackOptional(LUA, 2);
+
+	try
+	{
+		if (callbackRef == GarrysMod::Lua::Type::NONE)
+			ptr->m_iface.ping();
+		else
+			ptr->m_iface.ping([ptr, callbackRef](cpp_redis::reply& reply)
+				{
+					ptr->EnqueueAction({ redis::globals::actionType::Reply, {std::move(reply), callbackRef} });
+				});
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/auth/
+int redis::client::lua_Auth(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	const char* password = LUA->CheckString(2);
+	int callbackRef = GetCallbackOptional(LUA, 3);
+
+	ptr->m_inflightReads.clear();
+	ptr->m_transport->SetAuth({ "AUTH", password });
+
+	try
+	{
+		if (callbackRef == GarrysMod::Lua::Type::NONE)
+			ptr->m_iface.auth(password);
+		else
+			ptr->m_iface.auth(password, [ptr, callbackRef](cpp_redis::reply& reply)
+				{
+					ptr->EnqueueAction({ redis::globals::actionType::Reply, {std::move(reply), callbackRef} });
+				});
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/select/
+int redis::client::lua_Select(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	int database = LUA->CheckNumber(2);
+	int callbackRef = GetCallbackOptional(LUA, 3);
+
+	ptr->m_inflightReads.clear();
+	ptr->m_transport->SetDatabase({ "SELECT", std::to_string(database) });
+
+	try
+	{
+		if (callbackRef == GarrysMod::Lua::Type::NONE)
+			ptr->m_iface.select(database);
+		else
+			ptr->m_iface.select(database, [ptr, callbackRef](cpp_redis::reply& reply)
+				{
+					ptr->EnqueueAction({ redis::globals::actionType::Reply, {std::move(reply), callbackRef} });
+				});
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/publish/
+int redis::client::lua_Publish(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	const char* channel = LUA->CheckString(2);
+	const char* message = LUA->CheckString(3);
+	int callbackRef = GetCallbackOptional(LUA, 4);
+
+	try
+	{
+		ptr->Dispatch({ "PUBLISH", channel, message }, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/spublish/
+// Goes to the node this client is connected to, use redis.KeySlot to pick the client owning the channel in a cluster
+int redis::client::lua_SPublish(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	const char* channel = LUA->CheckString(2);
+	const char* message = LUA->CheckString(3);
+	int callbackRef = GetCallbackOptional(LUA, 4);
+
+	try
+	{
+		ptr->Dispatch({ "SPUBLISH", channel, message }, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/exists/
+int redis::client::lua_Exists(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	std::vector<std::string> keys = GetKeys(LUA, 2);
+	int callbackRef = GetCallback(LUA, 3);
+
+	keys.insert(keys.begin(), "EXISTS");
+
+	try
+	{
+		ptr->Dispatch(keys, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/delete/
+int redis::client::lua_Delete(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	std::vector<std::string> keys = GetKeys(LUA, 2);
+	int callbackRef = GetCallbackOptional(LUA, 3);
+
+	keys.insert(keys.begin(), "DEL");
+
+	try
+	{
+		ptr->Dispatch(keys, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/get/
+int redis::client::lua_Get(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	const char* key = LUA->CheckString(2);
+	int callbackRef = GetCallback(LUA, 3);
+
+	try
+	{
+		ptr->Dispatch({ "GET", key }, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/set/
+// Set(key, value, callback?, compress?)
+int redis::client::lua_Set(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	size_t len;
+	const char* key = LUA->CheckString(2);
+	LUA->CheckString(3);
+	const char* value = LUA->GetString(3, &len);
+	std::string stored = ptr->PrepareValue(LUA, value, len, 5);
+	int callbackRef = GetCallbackOptional(LUA, 4);
+
+	try
+	{
+		ptr->Dispatch({ "SET", key, std::move(stored) }, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/setex/
+// SetEx(key, seconds, value, callback?, compress?)
+int redis::client::lua_SetEx(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	size_t len;
+	const char* key = LUA->CheckString(2);
+	int secondsTtl = LUA->CheckNumber(3);
+	LUA->CheckString(4);
+	const char* value = LUA->GetString(4, &len);
+	std::string stored = ptr->PrepareValue(LUA, value, len, 6);
+	int callbackRef = GetCallbackOptional(LUA, 5);
+
+	try
+	{
+		ptr->Dispatch({ "SETEX", key, std::to_string(secondsTtl), std::move(stored) }, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/ttl/
+int redis::client::lua_TTL(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	const char* key = LUA->CheckString(2);
+	int callbackRef = GetCallback(LUA, 3);
+
+	try
+	{
+		ptr->Dispatch({ "TTL", key }, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/expire/
+int redis::client::lua_Expire(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	const char* key = LUA->CheckString(2);
+	int64_t seconds = static_cast<int64_t>(LUA->CheckNumber(3));
+	int callbackRef = GetCallbackOptional(LUA, 4);
+
+	try
+	{
+		ptr->Dispatch({ "EXPIRE", key, std::to_string(seconds) }, callbackRef);
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		return Exception(LUA, callbackRef, e);
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/incr/
+int redis::client::lua_Incr(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
-	std::vector<std::string> keys = GetKeys(LUA, 2);
+
+	const char* key = LUA->CheckString(2);
 	int callbackRef = GetCallbackOptional(LUA, 3);
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.send(keys);
-		else
-			ptr->m_iface.send(keys, [ptr, callbackRef](cpp_redis::reply& reply)
-			{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-			});
+		ptr->Dispatch({ "INCR", key }, callbackRef);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -219,22 +1436,18 @@ int redis::client::lua_Send(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/ping/
-int redis::client::lua_Ping(GarrysMod::Lua::ILuaBase* LUA)
+// https://redis.io/commands/incrby/
+int redis::client::lua_IncrBy(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
-	int callbackRef = GetCallbackOptional(LUA, 2);
+	const char* key = LUA->CheckString(2);
+	int64_t increment = static_cast<int64_t>(LUA->CheckNumber(3));
+	int callbackRef = GetCallbackOptional(LUA, 4);
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.ping();
-		else
-			ptr->m_iface.ping([ptr, callbackRef](cpp_redis::reply& reply)
-				{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-				});
+		ptr->Dispatch({ "INCRBY", key, std::to_string(increment) }, callbackRef);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -245,23 +1458,25 @@ int redis::client::lua_Ping(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/auth/
-int redis::client::lua_Auth(GarrysMod::Lua::ILuaBase* LUA)
+// https://redis.io/commands/mget/
+// MGet(key, ..., callback) or MGet({key, ...}, callback), replies with {key = value}
+int redis::client::lua_MGet(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
-	const char* password = LUA->CheckString(2);
-	int callbackRef = GetCallbackOptional(LUA, 3);
+	int lastArg;
+	LUA->CheckType(LUA->Top(), GarrysMod::Lua::Type::FUNCTION);
+	if (LUA->Top() < 3)
+		LUA->ArgError(2, "expected at least one key");
+
+	int callbackRef = GetTrailingCallback(LUA, lastArg);
+
+	std::vector<std::string> command = { "MGET" };
+	AppendArgs(LUA, 2, lastArg, command);
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.auth(password);
-		else
-			ptr->m_iface.auth(password, [ptr, callbackRef](cpp_redis::reply& reply)
-				{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-				});
+		ptr->DispatchKeyed(command, 1, callbackRef);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -272,23 +1487,32 @@ int redis::client::lua_Auth(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/select/
-int redis::client::lua_Select(GarrysMod::Lua::ILuaBase* LUA)
+// https://redis.io/commands/mset/
+// MSet(key, value, ..., callback?) or MSet({key = value, ...}, callback?)
+int redis::client::lua_MSet(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
-	int database = LUA->CheckNumber(2);
-	int callbackRef = GetCallbackOptional(LUA, 3);
+	int lastArg;
+	int callbackRef = GetTrailingCallback(LUA, lastArg);
+
+	std::vector<std::string> command = { "MSET" };
+	if (LUA->IsType(2, GarrysMod::Lua::Type::TABLE))
+		AppendPairs(LUA, 2, command);
+	else
+		AppendArgs(LUA, 2, lastArg, command);
+
+	if (command.size() < 3 || command.size() % 2 == 0)
+	{
+		if (callbackRef != GarrysMod::Lua::Type::NONE)
+			LUA->ReferenceFree(callbackRef);
+
+		LUA->ArgError(2, "expected key/value pairs");
+	}
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.select(database);
-		else
-			ptr->m_iface.select(database, [ptr, callbackRef](cpp_redis::reply& reply)
-				{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-				});
+		ptr->Dispatch(command, callbackRef);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -299,24 +1523,26 @@ int redis::client::lua_Select(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/publish/
-int redis::client::lua_Publish(GarrysMod::Lua::ILuaBase* LUA)
+// https://redis.io/commands/hmget/
+// HMGet(key, field, ..., callback) or HMGet(key, {field, ...}, callback), replies with {field = value}
+int redis::client::lua_HMGet(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
-	const char* channel = LUA->CheckString(2);
-	const char* message = LUA->CheckString(3);
-	int callbackRef = GetCallbackOptional(LUA, 4);
+	const char* key = LUA->CheckString(2);
+	LUA->CheckType(LUA->Top(), GarrysMod::Lua::Type::FUNCTION);
+	if (LUA->Top() < 4)
+		LUA->ArgError(3, "expected at least one field");
+
+	int lastArg;
+	int callbackRef = GetTrailingCallback(LUA, lastArg);
+
+	std::vector<std::string> command = { "HMGET", key };
+	AppendArgs(LUA, 3, lastArg, command);
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.publish(channel, message);
-		else
-			ptr->m_iface.publish(channel, message, [ptr, callbackRef](cpp_redis::reply& reply)
-				{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-				});
+		ptr->DispatchKeyed(command, 2, callbackRef);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -327,20 +1553,34 @@ int redis::client::lua_Publish(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/exists/
-int redis::client::lua_Exists(GarrysMod::Lua::ILuaBase* LUA)
+// https://redis.io/commands/hset/
+// HSet(key, field, value, ..., callback?) or HSet(key, {field = value, ...}, callback?)
+int redis::client::lua_HSet(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
-	std::vector<std::string> keys = GetKeys(LUA, 2);
-	int callbackRef = GetCallback(LUA, 3);
+	const char* key = LUA->CheckString(2);
+
+	int lastArg;
+	int callbackRef = GetTrailingCallback(LUA, lastArg);
+
+	std::vector<std::string> command = { "HSET", key };
+	if (LUA->IsType(3, GarrysMod::Lua::Type::TABLE))
+		AppendPairs(LUA, 3, command);
+	else
+		AppendArgs(LUA, 3, lastArg, command);
+
+	if (command.size() < 4 || command.size() % 2 != 0)
+	{
+		if (callbackRef != GarrysMod::Lua::Type::NONE)
+			LUA->ReferenceFree(callbackRef);
+
+		LUA->ArgError(3, "expected field/value pairs");
+	}
 
 	try
 	{
-		ptr->m_iface.exists(keys, [ptr, callbackRef](cpp_redis::reply& reply)
-			{
-				ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-			});
+		ptr->Dispatch(command, callbackRef);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -351,23 +1591,18 @@ int redis::client::lua_Exists(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/delete/
-int redis::client::lua_Delete(GarrysMod::Lua::ILuaBase* LUA)
+// https://redis.io/commands/hgetall/
+// Replies with {field = value}
+int redis::client::lua_HGetAll(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
-	std::vector<std::string> keys = GetKeys(LUA, 2);
-	int callbackRef = GetCallbackOptional(LUA, 3);
+	const char* key = LUA->CheckString(2);
+	int callbackRef = GetCallback(LUA, 3);
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.del(keys);
-		else
-			ptr->m_iface.del(keys, [ptr, callbackRef](cpp_redis::reply& reply)
-				{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-				});
+		ptr->Dispatch({ "HGETALL", key }, callbackRef, replyShape::Map);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -378,20 +1613,32 @@ int redis::client::lua_Delete(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/get/
-int redis::client::lua_Get(GarrysMod::Lua::ILuaBase* LUA)
+// SetTable(key, tbl, callback?, compress?), stores tbl as MessagePack instead of going through util.TableToJSON
+int redis::client::lua_SetTable(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
 	const char* key = LUA->CheckString(2);
-	int callbackRef = GetCallback(LUA, 3);
+	LUA->CheckType(3, GarrysMod::Lua::Type::TABLE);
 
+	std::string packed;
 	try
 	{
-		ptr->m_iface.get(key, [ptr, callbackRef](cpp_redis::reply& reply)
-			{
-				ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-			});
+		msgpack::Pack(LUA, 3, packed);
+	}
+	catch (const std::runtime_error& e)
+	{
+		LUA->PushNil();
+		LUA->PushString(e.what());
+		return 2;
+	}
+
+	std::string stored = ptr->PrepareValue(LUA, packed.data(), packed.size(), 5);
+	int callbackRef = GetCallbackOptional(LUA, 4);
+
+	try
+	{
+		ptr->Dispatch({ "SET", key, std::move(stored) }, callbackRef);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -402,24 +1649,17 @@ int redis::client::lua_Get(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/set/
-int redis::client::lua_Set(GarrysMod::Lua::ILuaBase* LUA)
+// GetTable(key, callback), callback(self, tbl, err) where tbl is nil if the key doesn't exist
+int redis::client::lua_GetTable(GarrysMod::Lua::ILuaBase* LUA)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
 	const char* key = LUA->CheckString(2);
-	const char* value = LUA->CheckString(3);
-	int callbackRef = GetCallbackOptional(LUA, 4);
+	int callbackRef = GetCallback(LUA, 3);
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.set(key, value);
-		else
-			ptr->m_iface.set(key, value, [ptr, callbackRef](cpp_redis::reply& reply)
-				{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-				});
+		ptr->Dispatch({ "GET", key }, callbackRef, replyShape::Packed);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -430,55 +1670,384 @@ int redis::client::lua_Set(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/setex/
-int redis::client::lua_SetEx(GarrysMod::Lua::ILuaBase* LUA)
+// Pages the network thread may fetch ahead of Lua before it parks the cursor
+static constexpr size_t maxBufferedPages = 2;
+
+static std::string RangeEnd(const scanCursor& scan)
+{
+	int64_t end = scan.nextOffset + scan.chunkSize - 1;
+	if (scan.rangeEnd >= 0 && scan.rangeEnd < end)
+		end = scan.rangeEnd;
+
+	return std::to_string(end);
+}
+
+// Points the cursor's command at the page after reply, returns false if reply was the last one
+static bool AdvanceCursor(scanCursor& scan, const cpp_redis::reply& reply)
+{
+	if (scan.chunkSize > 0)
+	{
+		if (!reply.is_bulk_string())
+			return false;
+
+		int64_t size = static_cast<int64_t>(reply.as_string().size());
+		scan.nextOffset += size;
+
+		if (size < scan.chunkSize || (scan.rangeEnd >= 0 && scan.nextOffset > scan.rangeEnd))
+			return false;
+
+		scan.command[scan.cursorIndex] = std::to_string(scan.nextOffset);
+		scan.command[scan.cursorIndex + 1] = RangeEnd(scan);
+		return true;
+	}
+
+	if (!reply.is_array() || reply.as_array().size() != 2 || !reply.as_array()[0].is_string())
+		return false;
+
+	const std::string& cursor = reply.as_array()[0].as_string();
+	if (cursor == "0")
+		return false;
+
+	scan.command[scan.cursorIndex] = cursor;
+	return true;
+}
+
+void redis::client::ScanNext(const std::shared_ptr<scanCursor>& scan)
+{
+	m_iface.send(scan->command, [this, scan](cpp_redis::reply& reply)
+		{
+			Resolve(reply);
+
+			// Slices of a compressed value can't be inflated on their own
+			if (scan->compressed)
+				reply = cpp_redis::reply("Value is compressed, read it with Get", cpp_redis::reply::string_type::error);
+
+			bool more;
+			{
+				std::lock_guard<std::mutex> lock(scan->mutex);
+
+				++scan->buffered;
+				more = !scan->finished && AdvanceCursor(*scan, reply);
+				if (more && scan->buffered >= maxBufferedPages)
+					scan->parked = true,
+					more = false;
+			}
+
+			EnqueueAction({ redis::globals::actionType::Page, {std::move(reply), GarrysMod::Lua::Type::NONE, scan->shape, scan} });
+
+			if (more)
+			{
+				try
+				{
+					ScanNext(scan);
+				}
+				catch (const cpp_redis::redis_error& e)
+				{
+					std::lock_guard<std::mutex> lock(scan->mutex);
+					++scan->buffered;
+
+					EnqueueAction({ redis::globals::actionType::Page, {cpp_redis::reply(e.what(), cpp_redis::reply::string_type::error), GarrysMod::Lua::Type::NONE, scan->shape, scan} });
+				}
+			}
+		});
+
+	m_iface.commit();
+}
+
+static void FinishScan(GarrysMod::Lua::ILuaBase* LUA, scanCursor& scan, const char* err)
+{
+	{
+		std::lock_guard<std::mutex> lock(scan.mutex);
+		scan.finished = true;
+		scan.parked = false;
+	}
+
+	if (scan.refOnDone > 0)
+	{
+		LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+		LUA->ReferencePush(scan.refOnDone);
+		LUA->Push(1);
+
+		if (err != nullptr)
+			LUA->PushString(err);
+		else
+			LUA->PushNil();
+
+		if (LUA->PCall(2, 0, -4) != 0)
+			redis::ErrorNoHalt(LUA, "[redis Scan callback error] ");
+
+		LUA->Pop();
+		LUA->ReferenceFree(scan.refOnDone);
+	}
+
+	LUA->ReferenceFree(scan.refOnPage);
+}
+
+void redis::client::HandlePage(GarrysMod::Lua::ILuaBase* LUA, clientAction& action)
+{
+	scanCursor& scan = *action.data.scan;
+	const cpp_redis::reply& reply = action.data.reply;
+
+	++m_pagesThisPoll;
+
+	{
+		std::lock_guard<std::mutex> lock(scan.mutex);
+		--scan.buffered;
+
+		// A page that was already in flight when the scan was stopped
+		if (scan.finished)
+			return;
+	}
+
+	bool last;
+	int args;
+
+	if (scan.chunkSize > 0)
+	{
+		if (!reply.is_bulk_string())
+		{
+			FinishScan(LUA, scan, reply.is_string() ? reply.as_string().c_str() : "Unexpected GETRANGE reply");
+			return;
+		}
+
+		const std::string& chunk = reply.as_string();
+		int64_t offset = scan.rangeStart + scan.delivered;
+
+		scan.delivered += static_cast<int64_t>(chunk.size());
+		last = static_cast<int64_t>(chunk.size()) < scan.chunkSize || (scan.rangeEnd >= 0 && scan.rangeStart + scan.delivered > scan.rangeEnd);
+
+		if (chunk.empty())
+		{
+			FinishScan(LUA, scan, nullptr);
+			return;
+		}
+
+		LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+		LUA->ReferencePush(scan.refOnPage);
+		LUA->Push(1);
+		LUA->PushString(chunk.c_str(), chunk.size());
+		LUA->PushNumber(static_cast<double>(offset));
+		args = 3;
+	}
+	else
+	{
+		if (!reply.is_array() || reply.as_array().size() != 2 || !reply.as_array()[0].is_string())
+		{
+			FinishScan(LUA, scan, reply.is_string() ? reply.as_string().c_str() : "Unexpected scan reply");
+			return;
+		}
+
+		last = reply.as_array()[0].as_string() == "0";
+
+		LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+		LUA->ReferencePush(scan.refOnPage);
+		LUA->Push(1);
+		PushReply(LUA, reply.as_array()[1], scan.shape);
+		args = 2;
+	}
+
+	bool stop = false;
+	if (LUA->PCall(args, 1, -args - 2) != 0)
+	{
+		redis::ErrorNoHalt(LUA, "[redis Scan callback error] ");
+		stop = true;
+	}
+	else
+	{
+		// Returning false from onPage stops the scan
+		stop = LUA->IsType(-1, GarrysMod::Lua::Type::BOOL) && !LUA->GetBool(-1);
+		LUA->Pop();
+	}
+
+	LUA->Pop();
+
+	if (stop || last)
+	{
+		FinishScan(LUA, scan, nullptr);
+		return;
+	}
+
+	bool resume = false;
+	{
+		std::lock_guard<std::mutex> lock(scan.mutex);
+		if (scan.parked)
+			scan.parked = false,
+			resume = true;
+	}
+
+	if (resume)
+	{
+		try
+		{
+			ScanNext(action.data.scan);
+		}
+		catch (const cpp_redis::redis_error& e)
+		{
+			FinishScan(LUA, scan, e.what());
+		}
+	}
+}
+
+int redis::client::StartScan(GarrysMod::Lua::ILuaBase* LUA, const char* command, bool keyed, replyShape shape)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
-	const char* key = LUA->CheckString(2);
-	int secondsTtl = LUA->CheckNumber(3);
-	const char* value = LUA->CheckString(4);
-	int callbackRef = GetCallbackOptional(LUA, 5);
+	std::shared_ptr<scanCursor> scan = std::make_shared<scanCursor>();
+	scan->shape = shape;
+
+	int arg = 2;
+	scan->command.push_back(command);
+	if (keyed)
+		scan->command.push_back(LUA->CheckString(arg++));
+
+	scan->cursorIndex = scan->command.size();
+	scan->command.push_back("0");
+
+	if (LUA->IsType(arg, GarrysMod::Lua::Type::STRING))
+	{
+		scan->command.push_back("MATCH");
+		scan->command.push_back(LUA->GetString(arg));
+	}
+
+	if (LUA->IsType(arg + 1, GarrysMod::Lua::Type::NUMBER))
+	{
+		scan->command.push_back("COUNT");
+		scan->command.push_back(std::to_string(static_cast<int64_t>(LUA->GetNumber(arg + 1))));
+	}
+
+	LUA->CheckType(arg + 2, GarrysMod::Lua::Type::FUNCTION);
+	if (LUA->Top() >= arg + 3 && !LUA->IsType(arg + 3, GarrysMod::Lua::Type::NIL))
+		LUA->CheckType(arg + 3, GarrysMod::Lua::Type::FUNCTION);
+
+	scan->refOnPage = GetCallback(LUA, arg + 2);
+	scan->refOnDone = GetCallbackOptional(LUA, arg + 3);
 
 	try
 	{
-		if (callbackRef == GarrysMod::Lua::Type::NONE)
-			ptr->m_iface.setex(key, secondsTtl, value);
-		else
-			ptr->m_iface.setex(key, secondsTtl, value, [ptr, callbackRef](cpp_redis::reply& reply)
-				{
-					ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-				});
+		ptr->ScanNext(scan);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
-		return Exception(LUA, callbackRef, e);
+		if (scan->refOnDone > 0)
+			LUA->ReferenceFree(scan->refOnDone);
+
+		return Exception(LUA, scan->refOnPage, e);
 	}
 
 	LUA->PushBool(true);
 	return 1;
 }
 
-// https://redis.io/commands/ttl/
-int redis::client::lua_TTL(GarrysMod::Lua::ILuaBase* LUA)
+// Maximum number of scan pages handed to Lua per Poll
+int redis::client::lua_SetPageLimit(GarrysMod::Lua::ILuaBase* LUA)
+{
+	client* ptr = GetClient(LUA, 1, true);
+
+	int limit = static_cast<int>(LUA->CheckNumber(2));
+	if (limit < 1)
+		LUA->ArgError(2, "page limit must be at least 1");
+
+	ptr->m_pageLimit = static_cast<size_t>(limit);
+	return 0;
+}
+
+// https://redis.io/commands/scan/
+// Scan(pattern?, count?, onPage(self, keys), onDone?(self, err)), returning false from onPage stops the scan
+int redis::client::lua_Scan(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return StartScan(LUA, "SCAN", false, replyShape::Array);
+}
+
+// https://redis.io/commands/hscan/
+// HScan(key, pattern?, count?, onPage(self, {field = value}), onDone?(self, err))
+int redis::client::lua_HScan(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return StartScan(LUA, "HSCAN", true, replyShape::Map);
+}
+
+// https://redis.io/commands/sscan/
+// SScan(key, pattern?, count?, onPage(self, members), onDone?(self, err))
+int redis::client::lua_SScan(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return StartScan(LUA, "SSCAN", true, replyShape::Array);
+}
+
+// https://redis.io/commands/zscan/
+// ZScan(key, pattern?, count?, onPage(self, {member = score}), onDone?(self, err))
+int redis::client::lua_ZScan(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return StartScan(LUA, "ZSCAN", true, replyShape::Scores);
+}
+
+int redis::client::StartChunkedRead(GarrysMod::Lua::ILuaBase* LUA, int64_t start, int64_t end, int arg)
 {
 	client* ptr = GetClient(LUA, 1, true);
 
 	const char* key = LUA->CheckString(2);
-	int callbackRef = GetCallback(LUA, 3);
+	int64_t chunkSize = static_cast<int64_t>(LUA->CheckNumber(arg));
+	if (chunkSize < 1)
+		LUA->ArgError(arg, "chunk size must be at least 1");
+
+	LUA->CheckType(arg + 1, GarrysMod::Lua::Type::FUNCTION);
+	if (LUA->Top() >= arg + 2 && !LUA->IsType(arg + 2, GarrysMod::Lua::Type::NIL))
+		LUA->CheckType(arg + 2, GarrysMod::Lua::Type::FUNCTION);
+
+	std::shared_ptr<scanCursor> scan = std::make_shared<scanCursor>();
+	scan->chunkSize = chunkSize;
+	scan->rangeStart = start;
+	scan->rangeEnd = end;
+	scan->nextOffset = start;
+	scan->shape = replyShape::Array;
+	scan->cursorIndex = 2;
+	scan->command = { "GETRANGE", key, std::to_string(start), RangeEnd(*scan) };
+
+	scan->refOnPage = GetCallback(LUA, arg + 1);
+	scan->refOnDone = GetCallbackOptional(LUA, arg + 2);
 
 	try
 	{
-		ptr->m_iface.ttl(key, [ptr, callbackRef](cpp_redis::reply& reply)
+		// Pipelined with the first chunk, its reply arrives first
+		ptr->m_iface.send({ "GETRANGE", key, "0", std::to_string(redis::lz4::headerSize) }, [ptr, scan](cpp_redis::reply& reply)
 			{
-				ptr->EnqueueAction({ redis::globals::actionType::Reply, {reply, callbackRef} });
-			});	
+				ptr->Resolve(reply);
+				scan->compressed = reply.is_bulk_string() && redis::lz4::IsCompressed(reply.as_string());
+			});
+
+		ptr->ScanNext(scan);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
-		return Exception(LUA, callbackRef, e);
+		if (scan->refOnDone > 0)
+			LUA->ReferenceFree(scan->refOnDone);
+
+		return Exception(LUA, scan->refOnPage, e);
 	}
 
 	LUA->PushBool(true);
 	return 1;
+}
+
+// GetChunked(key, chunkSize, onChunk(self, chunk, offset), onDone?(self, err))
+// Reads the value in GETRANGE slices so no more than a couple of chunks are buffered at once.
+// The slices are separate reads, a value rewritten mid-read is not returned atomically.
+// Compressed values can't be read in slices, onDone gets an error for them instead.
+int redis::client::lua_GetChunked(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return StartChunkedRead(LUA, 0, -1, 3);
+}
+
+// https://redis.io/commands/getrange/
+// GetRangeChunked(key, start, end, chunkSize, onChunk(self, chunk, offset), onDone?(self, err)), end -1 reads to the end of the value
+int redis::client::lua_GetRangeChunked(GarrysMod::Lua::ILuaBase* LUA)
+{
+	int64_t start = static_cast<int64_t>(LUA->CheckNumber(3));
+	int64_t end = static_cast<int64_t>(LUA->CheckNumber(4));
+
+	if (start < 0)
+		LUA->ArgError(3, "start must not be negative");
+
+	if (end < -1 || (end >= 0 && end < start))
+		LUA->ArgError(4, "end must be -1 or not before start");
+
+	return StartChunkedRead(LUA, start, end, 5);
 }
\ No newline at end of file
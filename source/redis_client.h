@@ -1,8 +1,52 @@
 #pragma once
 
+#include "redis_lz4.h"
+#include "redis_msgpack.h"
+#include "redis_pool.h"
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+// How an array reply is pushed to Lua
+enum class replyShape : uint8_t {
+	Array,	// {value, ...}
+	Map,	// {field = value}
+	Scores,	// {member = score}
+	Packed	// A MessagePack bulk string, unpacked on the network thread
+};
+
+// A SCAN family cursor walked by the network thread, handing pages to Lua through Poll
+// With chunkSize set it instead walks a value in GETRANGE slices of that many bytes
+struct scanCursor {
+	std::vector<std::string>	command;
+	size_t						cursorIndex;
+	replyShape					shape;
+	int32_t						refOnPage;
+	int32_t						refOnDone;
+
+	int64_t						chunkSize = 0;
+	int64_t						rangeStart = 0;
+	int64_t						rangeEnd = -1;
+	int64_t						nextOffset = 0;	// Network thread
+	int64_t						delivered = 0;	// Lua thread
+	bool						compressed = false;	// Network thread, set by the probe sent ahead of the first chunk
+
+	std::mutex					mutex;
+	size_t						buffered = 0;
+	bool						parked = false;
+	bool						finished = false;
+};
+
 struct clientActionData {
-	cpp_redis::reply	reply;
-	int32_t				reference;
+	cpp_redis::reply			reply;
+	int32_t						reference;
+	replyShape					shape = replyShape::Array;
+	std::shared_ptr<scanCursor>	scan;
+	std::vector<redis::msgpack::token>	unpacked;	// Packed replies
+	redis::resp::frame			native;		// Aggregate replies parsed by the transport, reply is unused then
 };
 typedef redis::action<clientActionData> clientAction;
 
@@ -11,16 +55,28 @@ namespace redis
 	class client : BaseInterface<clientAction, cpp_redis::client>
 	{
 	public:
-		client(GarrysMod::Lua::ILuaBase* LUA) : BaseInterface(LUA) { }
+		client(GarrysMod::Lua::ILuaBase* LUA);
+		~client();
 
 		static client* GetClient(GarrysMod::Lua::ILuaBase* LUA, int index, bool throwNullError) { return static_cast<client*>(_get(LUA, index, throwNullError)); }
 
 
 		static void Initialize(GarrysMod::Lua::ILuaBase* LUA);
-		void HandleAction(GarrysMod::Lua::ILuaBase* LUA, clientAction action);
+		void HandleAction(GarrysMod::Lua::ILuaBase* LUA, clientAction& action);
+		bool PollPending(GarrysMod::Lua::ILuaBase* LUA);
+		void ConnectionChanged(GarrysMod::Lua::ILuaBase* LUA, bool connected, const redis::connectionEvent& event);
+		void ReleaseReferences(GarrysMod::Lua::ILuaBase* LUA);
+		bool NeedsPoll() const { return !m_deadlines.empty() || !m_deferredPages.empty(); }
+		// Held commands may still go out if it reconnects in time
+		bool Drain() { return (m_held.empty() || !m_reconnect.Pending()) && DrainCommands(); }
+		void Abandon();
 
 		static int Exception(GarrysMod::Lua::ILuaBase* LUA, int reference, const cpp_redis::redis_error& e);
 
+		static void PushReply(GarrysMod::Lua::ILuaBase* LUA, const cpp_redis::reply& reply, replyShape shape = replyShape::Array);
+
+		static void InvokeCallback(GarrysMod::Lua::ILuaBase* LUA, int reference, const cpp_redis::reply& reply, replyShape shape, const std::vector<msgpack::token>* unpacked = nullptr, const resp::frame* native = nullptr);
+
 		static int GetCallback(GarrysMod::Lua::ILuaBase* LUA, int stackPos);
 
 		static int GetCallbackOptional(GarrysMod::Lua::ILuaBase* LUA, int stackPos);
@@ -29,12 +85,34 @@ namespace redis
 
 		static std::vector<std::string> CheckKeys(GarrysMod::Lua::ILuaBase* LUA, int stackPos);
 
+		static replyShape GetReplyShape(const std::vector<std::string>& command);
+
+		static int GetTrailingCallback(GarrysMod::Lua::ILuaBase* LUA, int& lastArg);
+
+		static void AppendArgs(GarrysMod::Lua::ILuaBase* LUA, int stackPos, int lastArg, std::vector<std::string>& command);
+
+		static void AppendPairs(GarrysMod::Lua::ILuaBase* LUA, int stackPos, std::vector<std::string>& command);
+
 		static int lua_Send(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetCoalescing(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetPageLimit(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetTimeout(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetCompression(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetNativeReplies(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SetProtocol(GarrysMod::Lua::ILuaBase* LUA);
+
+		static int lua_Scan(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_HScan(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SScan(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_ZScan(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_GetChunked(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_GetRangeChunked(GarrysMod::Lua::ILuaBase* LUA);
 
 		static int lua_Ping(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_Auth(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_Select(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_Publish(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SPublish(GarrysMod::Lua::ILuaBase* LUA);
 
 		static int lua_Exists(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_Delete(GarrysMod::Lua::ILuaBase* LUA);
@@ -43,6 +121,98 @@ namespace redis
 		static int lua_Set(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_SetEx(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_TTL(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_Expire(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_Incr(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_IncrBy(GarrysMod::Lua::ILuaBase* LUA);
+
+		static int lua_MGet(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_MSet(GarrysMod::Lua::ILuaBase* LUA);
+
+		static int lua_HMGet(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_HSet(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_HGetAll(GarrysMod::Lua::ILuaBase* LUA);
+
+		static int lua_SetTable(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_GetTable(GarrysMod::Lua::ILuaBase* LUA);
 	private:
+		struct coalescedRequest {
+			std::string				command;
+			std::vector<int32_t>	waiters;
+		};
+
+		struct deadline {
+			std::chrono::steady_clock::time_point	at;
+			int32_t									reference;
+			uint64_t								sequence;
+
+			bool operator>(const deadline& other) const { return at > other.at; }
+		};
+
+		struct heldCommand {
+			std::vector<std::string>	command;
+			int32_t						reference;
+			replyShape					shape;
+			size_t						firstKey;	// Replayed through DispatchKeyed when set
+		};
+
+		// Anything held goes out first, so this keeps holding until it has been replayed
+		// Returns false once there is nothing to hold for, throws if the policy fails it
+		bool Hold(const std::vector<std::string>& command, int callbackRef, replyShape shape, size_t firstKey, int64_t timeoutMs);
+
+		// Sends a command, attaching the callback to an identical in-flight read when coalescing is enabled
+		// While reconnecting it is held for the new connection instead, or throws if the policy fails it
+		// timeoutMs of -1 uses the client's default, 0 waits forever
+		void Dispatch(const std::vector<std::string>& command, int callbackRef, replyShape shape = replyShape::Array, int64_t timeoutMs = -1);
+
+		// Resolves the callback with a timeout error from Poll unless its reply arrives first
+		void Track(int callbackRef, int64_t timeoutMs = -1);
+		bool ExpireDeadlines(GarrysMod::Lua::ILuaBase* LUA);
+		void Expire(GarrysMod::Lua::ILuaBase* LUA, int32_t reference);
+
+		// Stops later reads from joining a coalesced request, returning the callbacks that already did
+		std::vector<int32_t> DetachWaiters(int32_t reference);
+
+		// Swaps a placeholder from the transport for the reply it stands for, for code that works on cpp_redis replies
+		void Resolve(cpp_redis::reply& reply);
+
+		// Returns the value to store, compressed when compress is set and it is over the threshold
+		// An optional boolean at compressArg overrides the client's SetCompression for this call
+		std::string PrepareValue(GarrysMod::Lua::ILuaBase* LUA, const char* value, size_t len, int compressArg) const;
+
+		// Sends a command whose array reply lines up with its arguments from firstKey on, replying with a map of them
+		// It is held while reconnecting just like Dispatch
+		void DispatchKeyed(const std::vector<std::string>& command, size_t firstKey, int callbackRef, int64_t timeoutMs = -1);
+
+		// Requests the next page of a cursor, called from both the Lua and network threads
+		void ScanNext(const std::shared_ptr<scanCursor>& scan);
+
+		// Delivers a page to its onPage callback and resumes the cursor if the network thread parked it
+		void HandlePage(GarrysMod::Lua::ILuaBase* LUA, clientAction& action);
+
+		// Delivers a RESP3 push, pub/sub messages to OnMessage and the rest to OnPush
+		void HandlePush(GarrysMod::Lua::ILuaBase* LUA, clientAction& action);
+
+		static int StartScan(GarrysMod::Lua::ILuaBase* LUA, const char* command, bool keyed, replyShape shape);
+		static int StartChunkedRead(GarrysMod::Lua::ILuaBase* LUA, int64_t start, int64_t end, int arg);
+
+		bool										m_coalesce = false;
+		size_t										m_pageLimit = 4;
+		size_t										m_pagesThisPoll = 0;
+		std::deque<clientAction>					m_deferredPages;
+		std::unordered_map<std::string, int32_t>	m_inflightReads;
+		std::unordered_map<int32_t, coalescedRequest>	m_coalesced;
+		std::deque<heldCommand>						m_held;
+
+		// Unpacked MessagePack replies, up to 64 vectors of at most 64 Ki tokens
+		bufferPool<std::vector<msgpack::token>>		m_tokenPool{ 64, 64 * 1024 };
+
+		bool										m_compress = false;
+		size_t										m_compressThreshold = 1024;
+
+		uint32_t									m_timeoutMs = 0;
+		uint64_t									m_deadlineSequence = 0;
+		std::priority_queue<deadline, std::vector<deadline>, std::greater<deadline>>	m_deadlines;
+		std::unordered_map<int32_t, uint64_t>		m_timed;	// Callbacks waiting with a deadline, stale heap entries don't match
+		std::unordered_set<int32_t>					m_timedOut;	// Already resolved, their late replies are dropped
 	};
 };
\ No newline at end of file
@@ -0,0 +1,288 @@
+#include "main.hpp"
+#include "redis_client.h"
+#include "redis_consumer.h"
+
+void redis::consumer::Initialize(GarrysMod::Lua::ILuaBase* LUA)
+{
+	BaseInterface::InitMetatable(LUA, "redis_consumer");
+
+	LUA->PushCFunction(wrap(lua_Start));
+	LUA->SetField(-2, "Start");
+
+	LUA->PushCFunction(wrap(lua_Stop));
+	LUA->SetField(-2, "Stop");
+
+	LUA->PushCFunction(wrap(lua_IsRunning));
+	LUA->SetField(-2, "IsRunning");
+
+	LUA->Pop();
+}
+
+// Finds the entries of the stream in an XREADGROUP reply, nullptr if the read timed out
+static const cpp_redis::reply* FindEntries(const cpp_redis::reply& reply, const std::string& stream)
+{
+	if (!reply.is_array())
+		return nullptr;
+
+	for (const cpp_redis::reply& streamReply : reply.as_array())
+	{
+		if (!streamReply.is_array() || streamReply.as_array().size() != 2)
+			continue;
+
+		const std::vector<cpp_redis::reply>& pair = streamReply.as_array();
+		if (pair[0].is_string() && pair[0].as_string() == stream && pair[1].is_array())
+			return &pair[1];
+	}
+
+	return nullptr;
+}
+
+void redis::consumer::ReadNext()
+{
+	m_reading = true;
+
+	m_iface.send({ "XREADGROUP", "GROUP", m_group, m_name, "COUNT", std::to_string(m_count), "BLOCK", std::to_string(m_blockMs), "STREAMS", m_stream, m_readId }, [this](cpp_redis::reply& reply)
+		{
+			if (!m_running)
+			{
+				m_reading = false;
+				return;
+			}
+
+			if (reply.is_error())
+			{
+				m_reading = false;
+				EnqueueAction({ redis::globals::actionType::Message, {std::move(reply)} });
+				return;
+			}
+
+			const cpp_redis::reply* entries = FindEntries(reply, m_stream);
+			if (entries == nullptr || entries->as_array().empty())
+			{
+				// Timed out, or our pending entries are drained, so block for new ones without involving Lua
+				m_readId = ">";
+
+				try
+				{
+					ReadNext();
+				}
+				catch (const cpp_redis::redis_error& e)
+				{
+					m_reading = false;
+					EnqueueAction({ redis::globals::actionType::Message, {cpp_redis::reply(e.what(), cpp_redis::reply::string_type::error)} });
+				}
+
+				return;
+			}
+
+			if (m_readId != ">")
+			{
+				const cpp_redis::reply& last = entries->as_array().back();
+				if (last.is_array() && !last.as_array().empty() && last.as_array()[0].is_string())
+					m_readId = last.as_array()[0].as_string();
+			}
+
+			// Lua issues the next read once the batch is handled, pipelined behind its XACK
+			m_reading = false;
+			EnqueueAction({ redis::globals::actionType::Message, {std::move(reply)} });
+		});
+
+	m_iface.commit();
+}
+
+void redis::consumer::Begin()
+{
+	// Replies BUSYGROUP when the group already exists, which is fine
+	m_iface.send({ "XGROUP", "CREATE", m_stream, m_group, "$", "MKSTREAM" }, [](cpp_redis::reply&) { });
+
+	m_readId = "0";
+	ReadNext();
+}
+
+bool redis::consumer::PollPending(GarrysMod::Lua::ILuaBase* LUA)
+{
+	if (!m_retry || !m_running || m_reading || std::chrono::steady_clock::now() < m_retryAt || !m_iface.is_connected())
+		return false;
+
+	m_retry = false;
+
+	try
+	{
+		Begin();
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		m_retry = true;
+		m_retryAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	}
+
+	return false;
+}
+
+void redis::consumer::HandleAction(GarrysMod::Lua::ILuaBase* LUA, consumerAction& action)
+{
+	if (action.type != redis::globals::actionType::Message)
+		return;
+
+	const cpp_redis::reply& reply = action.data.reply;
+	if (reply.is_error())
+	{
+		// Try again shortly, the group or connection may have gone away
+		m_retry = true;
+		m_retryAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+		LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+		if (redis::PushCallback(LUA, 0, 1, "OnError"))
+		{
+			LUA->Push(1);
+			LUA->PushString(reply.as_string().c_str());
+
+			if (LUA->PCall(2, 0, -4) != 0)
+				redis::ErrorNoHalt(LUA, "[redis OnError callback error] ");
+		}
+
+		LUA->Pop();
+		return;
+	}
+
+	if (!m_running)
+		return;
+
+	const cpp_redis::reply* entries = FindEntries(reply, m_stream);
+	if (entries == nullptr)
+		return;
+
+	std::vector<std::string> ack = { "XACK", m_stream, m_group };
+	ack.reserve(entries->as_array().size() + 3);
+
+	// {{id = id, data = {field = value}}, ...}
+	LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+	bool hasCallback = redis::PushCallback(LUA, m_refOnMessage, 1, "OnMessage");
+	if (hasCallback)
+	{
+		LUA->Push(1);
+		LUA->PushString(m_stream.c_str(), m_stream.size());
+		LUA->CreateTable();
+	}
+
+	int i = 1;
+	for (const cpp_redis::reply& entry : entries->as_array())
+	{
+		if (!entry.is_array() || entry.as_array().size() != 2 || !entry.as_array()[0].is_string())
+			continue;
+
+		const std::string& id = entry.as_array()[0].as_string();
+		ack.push_back(id);
+
+		// Entries deleted while pending come back without fields
+		if (!hasCallback || !entry.as_array()[1].is_array())
+			continue;
+
+		LUA->PushNumber(i++);
+		LUA->CreateTable();
+
+		LUA->PushString(id.c_str(), id.size());
+		LUA->SetField(-2, "id");
+
+		redis::client::PushReply(LUA, entry.as_array()[1], replyShape::Map);
+		LUA->SetField(-2, "data");
+
+		LUA->SetTable(-3);
+	}
+
+	bool acknowledge = true;
+	if (hasCallback)
+	{
+		// Entries stay pending if the callback errors or returns false, and are read again on the next Start
+		if (LUA->PCall(3, 1, -5) != 0)
+		{
+			redis::ErrorNoHalt(LUA, "[redis OnMessage callback error] ");
+			acknowledge = false;
+		}
+		else
+		{
+			acknowledge = !LUA->IsType(-1, GarrysMod::Lua::Type::BOOL) || LUA->GetBool(-1);
+			LUA->Pop();
+		}
+	}
+
+	LUA->Pop();
+
+	try
+	{
+		if (acknowledge && ack.size() > 3)
+			m_iface.send(ack, [](cpp_redis::reply&) { });
+
+		if (m_running)
+			ReadNext();
+		else
+			m_iface.commit();
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		m_reading = false;
+		m_retry = true;
+		m_retryAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	}
+}
+
+// Start(stream, group, consumer, count?, blockMs?)
+// Batches of up to count entries are passed to OnMessage(self, stream, entries) and acknowledged unless it returns false
+int redis::consumer::lua_Start(GarrysMod::Lua::ILuaBase* LUA)
+{
+	consumer* ptr = GetConsumer(LUA, 1, true);
+
+	const char* stream = LUA->CheckString(2);
+	const char* group = LUA->CheckString(3);
+	const char* name = LUA->CheckString(4);
+
+	if (ptr->m_running || ptr->m_reading)
+	{
+		LUA->PushNil();
+		LUA->PushString("Consumer is already running");
+		return 2;
+	}
+
+	ptr->m_stream = stream;
+	ptr->m_group = group;
+	ptr->m_name = name;
+	ptr->m_count = LUA->IsType(5, GarrysMod::Lua::Type::NUMBER) ? static_cast<int64_t>(LUA->GetNumber(5)) : 100;
+	ptr->m_blockMs = LUA->IsType(6, GarrysMod::Lua::Type::NUMBER) ? static_cast<int64_t>(LUA->GetNumber(6)) : 5000;
+	ptr->m_retry = false;
+	ptr->m_running = true;
+
+	try
+	{
+		ptr->Begin();
+	}
+	catch (const cpp_redis::redis_error& e)
+	{
+		ptr->m_running = false;
+		ptr->m_reading = false;
+
+		LUA->PushNil();
+		LUA->PushString(e.what());
+		return 2;
+	}
+
+	LUA->PushBool(true);
+	return 1;
+}
+
+// Stops after the read in flight returns, entries it delivers stay pending until the next Start
+int redis::consumer::lua_Stop(GarrysMod::Lua::ILuaBase* LUA)
+{
+	consumer* ptr = GetConsumer(LUA, 1, true);
+
+	ptr->m_running = false;
+	ptr->m_retry = false;
+	return 0;
+}
+
+int redis::consumer::lua_IsRunning(GarrysMod::Lua::ILuaBase* LUA)
+{
+	consumer* ptr = GetConsumer(LUA, 1, true);
+
+	LUA->PushBool(ptr->m_running);
+	return 1;
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+struct consumerActionData {
+	cpp_redis::reply	reply;
+};
+typedef redis::action<consumerActionData> consumerAction;
+
+namespace redis
+{
+	class consumer : BaseInterface<consumerAction, cpp_redis::client>
+	{
+	public:
+		consumer(GarrysMod::Lua::ILuaBase* LUA) : BaseInterface(LUA, interfaceKind::Consumer) { }
+
+		static consumer* GetConsumer(GarrysMod::Lua::ILuaBase* LUA, int index, bool throwNullError) { return static_cast<consumer*>(_get(LUA, index, throwNullError)); }
+
+		static void Initialize(GarrysMod::Lua::ILuaBase* LUA);
+		void HandleAction(GarrysMod::Lua::ILuaBase* LUA, consumerAction& action);
+		bool PollPending(GarrysMod::Lua::ILuaBase* LUA);
+		bool NeedsPoll() const { return m_retry && m_running; }
+
+		// Stops like Stop without waiting on the blocked XREADGROUP, its entries stay pending for the next Start
+		bool Drain() { m_running = false; m_retry = false; return true; }
+
+		static int lua_Start(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_Stop(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_IsRunning(GarrysMod::Lua::ILuaBase* LUA);
+	private:
+		// Issues the next XREADGROUP, called from both the Lua and network threads
+		void ReadNext();
+
+		// Creates the group if needed and starts reading from this consumer's pending entries
+		void Begin();
+
+		std::string			m_stream;
+		std::string			m_group;
+		std::string			m_name;
+		int64_t				m_count = 100;
+		int64_t				m_blockMs = 5000;
+
+		// "0"-based ids while re-reading our pending entries, ">" once they are drained
+		std::string			m_readId;
+
+		std::atomic<bool>	m_running{ false };
+		std::atomic<bool>	m_reading{ false };
+
+		bool				m_retry = false;
+		std::chrono::steady_clock::time_point m_retryAt;
+	};
+};
\ No newline at end of file
@@ -0,0 +1,211 @@
+#include "redis_lz4.h"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+static constexpr char tag[] = { '\x1b', 'L', 'Z', '\x01' };
+static_assert(redis::lz4::headerSize == sizeof(tag) + 4, "header is the tag and a 32 bit size");
+
+// The block format requires the last 5 bytes to be literals and the last match to start 12 bytes before the end
+static constexpr size_t minMatch = 4;
+static constexpr size_t lastLiterals = 5;
+static constexpr size_t matchStartLimit = 12;
+static constexpr size_t maxOffset = 65535;
+static constexpr int hashBits = 12;
+
+// Redis refuses larger strings, so a bigger size can only come from a corrupt header
+static constexpr uint32_t maxValueSize = 512 * 1024 * 1024;
+
+static uint32_t Read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t Hash(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - hashBits);
+}
+
+static void WriteLength(std::string& out, size_t length)
+{
+	for (; length >= 255; length -= 255)
+		out.push_back(static_cast<char>(255));
+
+	out.push_back(static_cast<char>(length));
+}
+
+static void WriteSequence(std::string& out, const uint8_t* literals, size_t literalLength, size_t offset, size_t matchLength)
+{
+	size_t extra = matchLength >= minMatch ? matchLength - minMatch : 0;
+	uint8_t token = static_cast<uint8_t>((literalLength < 15 ? literalLength : 15) << 4);
+	if (matchLength >= minMatch)
+		token |= extra < 15 ? extra : 15;
+
+	out.push_back(static_cast<char>(token));
+	if (literalLength >= 15)
+		WriteLength(out, literalLength - 15);
+
+	out.append(reinterpret_cast<const char*>(literals), literalLength);
+
+	// The last sequence carries only literals
+	if (matchLength < minMatch)
+		return;
+
+	out.push_back(static_cast<char>(offset & 0xFF));
+	out.push_back(static_cast<char>(offset >> 8));
+	if (extra >= 15)
+		WriteLength(out, extra - 15);
+}
+
+bool redis::lz4::Compress(const char* data, size_t size, std::string& out)
+{
+	if (size <= headerSize || size > maxValueSize)
+		return false;
+
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+
+	std::string block;
+	block.reserve(headerSize + size / 2);
+	block.append(tag, sizeof(tag));
+	for (int i = 0; i < 4; ++i)
+		block.push_back(static_cast<char>((size >> (i * 8)) & 0xFF));
+
+	size_t anchor = 0;
+	if (size > matchStartLimit)
+	{
+		std::vector<uint32_t> table(1 << hashBits, 0);
+		size_t matchLimit = size - lastLiterals;
+		size_t pos = 1;
+
+		while (pos <= size - matchStartLimit)
+		{
+			uint32_t sequence = Read32(src + pos);
+			uint32_t& slot = table[Hash(sequence)];
+			size_t candidate = slot;
+			slot = static_cast<uint32_t>(pos);
+
+			if (candidate >= pos || pos - candidate > maxOffset || Read32(src + candidate) != sequence)
+			{
+				// Skip ahead faster the longer nothing matched, so incompressible data stays cheap
+				pos += 1 + ((pos - anchor) >> 6);
+				continue;
+			}
+
+			while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1])
+			{
+				--pos;
+				--candidate;
+			}
+
+			size_t length = minMatch;
+			while (pos + length < matchLimit && src[pos + length] == src[candidate + length])
+				++length;
+
+			WriteSequence(block, src + anchor, pos - anchor, pos - candidate, length);
+
+			pos += length;
+			anchor = pos;
+
+			// Keeps runs of repeated matches chaining off each other
+			if (pos <= size - matchStartLimit)
+				table[Hash(Read32(src + pos - 2))] = static_cast<uint32_t>(pos - 2);
+		}
+	}
+
+	WriteSequence(block, src + anchor, size - anchor, 0, 0);
+
+	if (block.size() >= size)
+		return false;
+
+	out = std::move(block);
+	return true;
+}
+
+bool redis::lz4::IsCompressed(const char* data, size_t size)
+{
+	return size > headerSize && memcmp(data, tag, sizeof(tag)) == 0;
+}
+
+std::string redis::lz4::Decompress(const char* data, size_t size)
+{
+	if (!IsCompressed(data, size))
+		throw std::runtime_error("Not a compressed value");
+
+	const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+
+	uint32_t originalSize = 0;
+	for (int i = 0; i < 4; ++i)
+		originalSize |= static_cast<uint32_t>(src[sizeof(tag) + i]) << (i * 8);
+
+	if (originalSize > maxValueSize)
+		throw std::runtime_error("Compressed value is too large");
+
+	std::string out(originalSize, '\0');
+	uint8_t* dst = reinterpret_cast<uint8_t*>(&out[0]);
+
+	auto readLength = [&](size_t& ip) -> size_t
+		{
+			size_t length = 0;
+			uint8_t byte;
+			do
+			{
+				if (ip >= size)
+					throw std::runtime_error("Compressed value is truncated");
+
+				byte = src[ip++];
+				length += byte;
+			} while (byte == 255);
+
+			return length;
+		};
+
+	size_t ip = headerSize, op = 0;
+	while (ip < size)
+	{
+		uint8_t token = src[ip++];
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15)
+			literalLength += readLength(ip);
+
+		if (literalLength > size - ip || literalLength > originalSize - op)
+			throw std::runtime_error("Compressed value is corrupt");
+
+		memcpy(dst + op, src + ip, literalLength);
+		ip += literalLength;
+		op += literalLength;
+
+		if (ip == size)
+			break;
+
+		if (size - ip < 2)
+			throw std::runtime_error("Compressed value is truncated");
+
+		size_t offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+
+		size_t matchLength = token & 15;
+		if (matchLength == 15)
+			matchLength += readLength(ip);
+
+		matchLength += minMatch;
+
+		if (offset == 0 || offset > op || matchLength > originalSize - op)
+			throw std::runtime_error("Compressed value is corrupt");
+
+		// Byte by byte, matches may overlap what they are copying
+		const uint8_t* match = dst + op - offset;
+		for (size_t i = 0; i < matchLength; ++i)
+			dst[op + i] = match[i];
+
+		op += matchLength;
+	}
+
+	if (op != originalSize)
+		throw std::runtime_error("Compressed value is truncated");
+
+	return out;
+}
\ No newline at end of file
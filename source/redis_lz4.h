@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+namespace redis
+{
+	// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+	// Values are stored as a tag and their original size followed by a single LZ4 block
+	namespace lz4
+	{
+		// Tag and original size, IsCompressed needs a little more than this
+		constexpr size_t headerSize = 8;
+
+		// Leaves out untouched and returns false when compressing wouldn't make data smaller
+		bool Compress(const char* data, size_t size, std::string& out);
+
+		bool IsCompressed(const char* data, size_t size);
+		inline bool IsCompressed(const std::string& data) { return IsCompressed(data.data(), data.size()); }
+
+		// Safe from any thread, throws std::runtime_error on malformed data
+		std::string Decompress(const char* data, size_t size);
+		inline std::string Decompress(const std::string& data) { return Decompress(data.data(), data.size()); }
+	};
+};
\ No newline at end of file
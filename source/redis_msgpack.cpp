@@ -0,0 +1,363 @@
+#include "main.hpp"
+#include "redis_msgpack.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+// Deeper tables are most likely cycles
+static constexpr int maxDepth = 64;
+
+static void WriteBig(std::string& out, uint8_t prefix, uint64_t value, int bytes)
+{
+	out.push_back(static_cast<char>(prefix));
+	for (int i = bytes - 1; i >= 0; --i)
+		out.push_back(static_cast<char>((value >> (i * 8)) & 0xFF));
+}
+
+static void PackHeader(std::string& out, uint32_t size, uint8_t fix, uint8_t fixLimit, uint8_t prefix16, uint8_t prefix32)
+{
+	if (size < fixLimit)
+		out.push_back(static_cast<char>(fix | size));
+	else if (size <= 0xFFFF)
+		WriteBig(out, prefix16, size, 2);
+	else
+		WriteBig(out, prefix32, size, 4);
+}
+
+static void PackNumber(std::string& out, double value)
+{
+	if (std::floor(value) != value || value < -9223372036854775808.0 || value >= 9223372036854775808.0)
+	{
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		WriteBig(out, 0xcb, bits, 8);
+		return;
+	}
+
+	int64_t integer = static_cast<int64_t>(value);
+	if (integer >= 0)
+	{
+		if (integer < 128)
+			out.push_back(static_cast<char>(integer));
+		else if (integer <= 0xFF)
+			WriteBig(out, 0xcc, integer, 1);
+		else if (integer <= 0xFFFF)
+			WriteBig(out, 0xcd, integer, 2);
+		else if (integer <= 0xFFFFFFFFLL)
+			WriteBig(out, 0xce, integer, 4);
+		else
+			WriteBig(out, 0xcf, integer, 8);
+	}
+	else if (integer >= -32)
+		out.push_back(static_cast<char>(integer));
+	else if (integer >= INT8_MIN)
+		WriteBig(out, 0xd0, static_cast<uint64_t>(integer), 1);
+	else if (integer >= INT16_MIN)
+		WriteBig(out, 0xd1, static_cast<uint64_t>(integer), 2);
+	else if (integer >= INT32_MIN)
+		WriteBig(out, 0xd2, static_cast<uint64_t>(integer), 4);
+	else
+		WriteBig(out, 0xd3, static_cast<uint64_t>(integer), 8);
+}
+
+static void PackValue(GarrysMod::Lua::ILuaBase* LUA, int index, std::string& out, int depth)
+{
+	switch (LUA->GetType(index))
+	{
+	case GarrysMod::Lua::Type::NIL:
+		out.push_back(static_cast<char>(0xc0));
+		break;
+
+	case GarrysMod::Lua::Type::BOOL:
+		out.push_back(static_cast<char>(LUA->GetBool(index) ? 0xc3 : 0xc2));
+		break;
+
+	case GarrysMod::Lua::Type::NUMBER:
+		PackNumber(out, LUA->GetNumber(index));
+		break;
+
+	case GarrysMod::Lua::Type::STRING:
+	{
+		size_t len;
+		const char* str = LUA->GetString(index, &len);
+
+		if (len < 32)
+			out.push_back(static_cast<char>(0xa0 | len));
+		else if (len <= 0xFF)
+			WriteBig(out, 0xd9, len, 1);
+		else
+			PackHeader(out, static_cast<uint32_t>(len), 0, 0, 0xda, 0xdb);
+
+		out.append(str, len);
+		break;
+	}
+
+	case GarrysMod::Lua::Type::TABLE:
+	{
+		if (depth >= maxDepth)
+			throw std::runtime_error("table nesting too deep, is it recursive?");
+
+		// Tables keyed 1..n are packed as arrays, anything else as maps
+		uint32_t count = 0;
+		double highest = 0;
+		bool sequence = true;
+
+		LUA->PushNil();
+		while (LUA->Next(index))
+		{
+			++count;
+
+			if (sequence)
+			{
+				double key = LUA->IsType(-2, GarrysMod::Lua::Type::NUMBER) ? LUA->GetNumber(-2) : 0;
+				sequence = key >= 1 && std::floor(key) == key;
+				highest = std::max(highest, key);
+			}
+
+			LUA->Pop();
+		}
+
+		// Distinct positive integer keys with the highest equal to the count can only be 1..n
+		sequence = sequence && highest == count;
+
+		if (sequence)
+		{
+			PackHeader(out, count, 0x90, 16, 0xdc, 0xdd);
+
+			for (uint32_t i = 1; i <= count; ++i)
+			{
+				LUA->PushNumber(i);
+				LUA->GetTable(index);
+				PackValue(LUA, LUA->Top(), out, depth + 1);
+				LUA->Pop();
+			}
+		}
+		else
+		{
+			PackHeader(out, count, 0x80, 16, 0xde, 0xdf);
+
+			LUA->PushNil();
+			while (LUA->Next(index))
+			{
+				int top = LUA->Top();
+				PackValue(LUA, top - 1, out, depth + 1);
+				PackValue(LUA, top, out, depth + 1);
+				LUA->Pop();
+			}
+		}
+		break;
+	}
+
+	default:
+		throw std::runtime_error(std::string("cannot pack a ") + LUA->GetTypeName(LUA->GetType(index)));
+	}
+}
+
+void redis::msgpack::Pack(GarrysMod::Lua::ILuaBase* LUA, int index, std::string& out)
+{
+	if (index < 0)
+		index = LUA->Top() + index + 1;
+
+	int top = LUA->Top();
+
+	try
+	{
+		PackValue(LUA, index, out, 0);
+	}
+	catch (const std::runtime_error&)
+	{
+		LUA->Pop(LUA->Top() - top);
+		throw;
+	}
+}
+
+namespace
+{
+	struct reader {
+		const std::string&	data;
+		size_t				pos = 0;
+
+		void Need(size_t bytes)
+		{
+			if (data.size() - pos < bytes)
+				throw std::runtime_error("truncated MessagePack value");
+		}
+
+		uint64_t Big(int bytes)
+		{
+			Need(bytes);
+
+			uint64_t value = 0;
+			for (int i = 0; i < bytes; ++i)
+				value = (value << 8) | static_cast<uint8_t>(data[pos++]);
+
+			return value;
+		}
+	};
+}
+
+static void UnpackValue(reader& in, std::vector<redis::msgpack::token>& tokens, int depth)
+{
+	using redis::msgpack::tokenType;
+
+	if (depth >= maxDepth)
+		throw std::runtime_error("MessagePack value nested too deep");
+
+	redis::msgpack::token token;
+	uint8_t byte = static_cast<uint8_t>(in.Big(1));
+
+	uint64_t length = 0;
+	if (byte <= 0x7f || byte >= 0xe0)
+	{
+		token.type = tokenType::Integer;
+		token.integer = static_cast<int8_t>(byte);
+	}
+	else if (byte >= 0xa0 && byte <= 0xbf)
+		token.type = tokenType::String, length = byte & 0x1f;
+	else if (byte >= 0x90 && byte <= 0x9f)
+		token.type = tokenType::Array, length = byte & 0x0f;
+	else if (byte >= 0x80 && byte <= 0x8f)
+		token.type = tokenType::Map, length = byte & 0x0f;
+	else
+		switch (byte)
+		{
+		case 0xc0: token.type = tokenType::Nil; break;
+		case 0xc2: token.type = tokenType::Bool, token.boolean = false; break;
+		case 0xc3: token.type = tokenType::Bool, token.boolean = true; break;
+
+		case 0xcc: token.type = tokenType::Integer, token.integer = static_cast<int64_t>(in.Big(1)); break;
+		case 0xcd: token.type = tokenType::Integer, token.integer = static_cast<int64_t>(in.Big(2)); break;
+		case 0xce: token.type = tokenType::Integer, token.integer = static_cast<int64_t>(in.Big(4)); break;
+		case 0xcf: token.type = tokenType::Float, token.number = static_cast<double>(in.Big(8)); break;
+		case 0xd0: token.type = tokenType::Integer, token.integer = static_cast<int8_t>(in.Big(1)); break;
+		case 0xd1: token.type = tokenType::Integer, token.integer = static_cast<int16_t>(in.Big(2)); break;
+		case 0xd2: token.type = tokenType::Integer, token.integer = static_cast<int32_t>(in.Big(4)); break;
+		case 0xd3: token.type = tokenType::Integer, token.integer = static_cast<int64_t>(in.Big(8)); break;
+
+		case 0xca:
+		{
+			uint32_t bits = static_cast<uint32_t>(in.Big(4));
+			float value;
+			std::memcpy(&value, &bits, sizeof(value));
+			token.type = tokenType::Float, token.number = value;
+			break;
+		}
+		case 0xcb:
+		{
+			uint64_t bits = in.Big(8);
+			std::memcpy(&token.number, &bits, sizeof(token.number));
+			token.type = tokenType::Float;
+			break;
+		}
+
+		// Binary is handed to Lua as a string too
+		case 0xd9: case 0xc4: token.type = tokenType::String, length = in.Big(1); break;
+		case 0xda: case 0xc5: token.type = tokenType::String, length = in.Big(2); break;
+		case 0xdb: case 0xc6: token.type = tokenType::String, length = in.Big(4); break;
+
+		case 0xdc: token.type = tokenType::Array, length = in.Big(2); break;
+		case 0xdd: token.type = tokenType::Array, length = in.Big(4); break;
+		case 0xde: token.type = tokenType::Map, length = in.Big(2); break;
+		case 0xdf: token.type = tokenType::Map, length = in.Big(4); break;
+
+		default:
+			throw std::runtime_error("unsupported MessagePack type");
+		}
+
+	token.size = static_cast<uint32_t>(length);
+
+	if (token.type == tokenType::String)
+	{
+		in.Need(length);
+		token.offset = in.pos;
+		in.pos += length;
+	}
+
+	// Every element takes at least a byte, so a bogus count can't make us reserve gigabytes
+	if (token.type == tokenType::Array || token.type == tokenType::Map)
+		in.Need(token.type == tokenType::Map ? length * 2 : length);
+
+	tokens.push_back(token);
+
+	uint64_t values = token.type == tokenType::Map ? length * 2 : (token.type == tokenType::Array ? length : 0);
+	for (uint64_t i = 0; i < values; ++i)
+		UnpackValue(in, tokens, depth + 1);
+}
+
+void redis::msgpack::Unpack(const std::string& data, std::vector<token>& tokens)
+{
+	tokens.reserve(data.size() / 4 + 1);
+
+	reader in{ data };
+	UnpackValue(in, tokens, 0);
+
+	if (in.pos != data.size())
+		throw std::runtime_error("trailing data after MessagePack value");
+}
+
+static void PushToken(GarrysMod::Lua::ILuaBase* LUA, const std::string& data, const std::vector<redis::msgpack::token>& tokens, size_t& i)
+{
+	using redis::msgpack::tokenType;
+
+	const redis::msgpack::token& token = tokens[i++];
+	switch (token.type)
+	{
+	case tokenType::Nil:
+		LUA->PushNil();
+		break;
+
+	case tokenType::Bool:
+		LUA->PushBool(token.boolean);
+		break;
+
+	case tokenType::Integer:
+		LUA->PushNumber(static_cast<double>(token.integer));
+		break;
+
+	case tokenType::Float:
+		LUA->PushNumber(token.number);
+		break;
+
+	case tokenType::String:
+		LUA->PushString(data.data() + token.offset, token.size);
+		break;
+
+	case tokenType::Array:
+		LUA->CreateTable();
+		for (uint32_t k = 1; k <= token.size; ++k)
+		{
+			LUA->PushNumber(k);
+			PushToken(LUA, data, tokens, i);
+			LUA->SetTable(-3);
+		}
+		break;
+
+	case tokenType::Map:
+		LUA->CreateTable();
+		for (uint32_t k = 0; k < token.size; ++k)
+		{
+			PushToken(LUA, data, tokens, i);
+			PushToken(LUA, data, tokens, i);
+
+			// Lua tables can't hold nil or NaN keys
+			if (LUA->IsType(-2, GarrysMod::Lua::Type::NIL) || (LUA->IsType(-2, GarrysMod::Lua::Type::NUMBER) && std::isnan(LUA->GetNumber(-2))))
+				LUA->Pop(2);
+			else
+				LUA->SetTable(-3);
+		}
+		break;
+	}
+}
+
+void redis::msgpack::Push(GarrysMod::Lua::ILuaBase* LUA, const std::string& data, const std::vector<token>& tokens)
+{
+	if (tokens.empty())
+	{
+		LUA->PushNil();
+		return;
+	}
+
+	size_t i = 0;
+	PushToken(LUA, data, tokens, i);
+}
\ No newline at end of file
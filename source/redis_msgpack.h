@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace redis
+{
+	// https://github.com/msgpack/msgpack/blob/master/spec.md
+	namespace msgpack
+	{
+		enum class tokenType : uint8_t {
+			Nil,
+			Bool,
+			Integer,
+			Float,
+			String,
+			Array,	// Followed by size values
+			Map		// Followed by size key, value pairs
+		};
+
+		// One decoded value, strings point back into the packed data instead of being copied
+		struct token {
+			tokenType	type;
+			uint32_t	size = 0;
+			union {
+				bool	boolean;
+				int64_t	integer;
+				double	number;
+				size_t	offset;
+			};
+		};
+
+		// Packs the value at index, throws std::runtime_error for values that can't be represented
+		void Pack(GarrysMod::Lua::ILuaBase* LUA, int index, std::string& out);
+
+		// Safe from any thread, fills the empty tokens so a reused vector keeps its capacity
+		// Throws std::runtime_error on malformed data
+		void Unpack(const std::string& data, std::vector<token>& tokens);
+
+		// Pushes the unpacked value as a single Lua value
+		void Push(GarrysMod::Lua::ILuaBase* LUA, const std::string& data, const std::vector<token>& tokens);
+	};
+};
\ No newline at end of file
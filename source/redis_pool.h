@@ -0,0 +1,36 @@
+#pragma once
+
+#include "readerwriterqueue.hpp"
+
+namespace redis
+{
+	// Buffers handed back from the Lua thread for the network thread to fill again, so steady traffic stops allocating
+	// T is any container with clear() and capacity(), larger ones are freed instead of kept
+	template <typename T>
+	class bufferPool
+	{
+	public:
+		bufferPool(size_t maxPooled, size_t maxCapacity) : m_free(maxPooled), m_maxPooled(maxPooled), m_maxCapacity(maxCapacity) { }
+
+		// Network thread, returns an empty buffer that may still hold its old capacity
+		T Take()
+		{
+			T buffer;
+			if (m_free.try_dequeue(buffer))
+				buffer.clear();
+
+			return buffer;
+		}
+
+		// Lua thread
+		void Give(T&& buffer)
+		{
+			if (buffer.capacity() != 0 && buffer.capacity() <= m_maxCapacity && m_free.size_approx() < m_maxPooled)
+				m_free.enqueue(std::move(buffer));
+		}
+	private:
+		moodycamel::ReaderWriterQueue<T>	m_free;
+		size_t								m_maxPooled;
+		size_t								m_maxCapacity;
+	};
+};
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include "redis_reconnect.h"
+#include <algorithm>
+#include <cmath>
+
+redis::reconnector::reconnector(const attempt_t& attempt, const failed_t& failed)
+	: m_attempt(attempt), m_failed(failed), m_random(std::random_device()())
+{
+}
+
+redis::reconnector::~reconnector()
+{
+	Stop();
+}
+
+void redis::reconnector::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_stop = true;
+		m_pending = false;
+	}
+
+	m_wake.notify_all();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void redis::reconnector::SetPolicy(const reconnectPolicy& policy)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_policy = policy;
+	m_policy.baseMs = std::max<uint32_t>(m_policy.baseMs, 1);
+	m_policy.maxMs = std::max(m_policy.maxMs, m_policy.baseMs);
+}
+
+redis::reconnectPolicy redis::reconnector::GetPolicy()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_policy;
+}
+
+int64_t redis::reconnector::NextDelay(uint32_t attempt)
+{
+	// Equal jitter, anywhere between half and all of the doubled delay
+	double ceiling = std::min(static_cast<double>(m_policy.maxMs), m_policy.baseMs * std::pow(2.0, std::min<uint32_t>(attempt, 31)));
+	std::uniform_int_distribution<int64_t> jitter(static_cast<int64_t>(ceiling / 2), static_cast<int64_t>(ceiling));
+
+	return jitter(m_random);
+}
+
+redis::connectionEvent redis::reconnector::Schedule()
+{
+	connectionEvent event;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_stop || m_policy.maxAttempts == 0)
+			return event;
+
+		m_pending = true;
+		m_attempts = 0;
+
+		event.retryInMs = NextDelay(0);
+		m_due = std::chrono::steady_clock::now() + std::chrono::milliseconds(event.retryInMs);
+
+		if (!m_thread.joinable())
+			m_thread = std::thread(&reconnector::Run, this);
+	}
+
+	m_wake.notify_all();
+	return event;
+}
+
+void redis::reconnector::Cancel()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_pending = false;
+	m_attempts = 0;
+	m_wake.wait(lock, [this] { return !m_attempting; });
+}
+
+uint32_t redis::reconnector::Connected()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	uint32_t attempt = m_pending ? m_attempts.load() : 0;
+	m_pending = false;
+	m_attempts = 0;
+
+	return attempt;
+}
+
+void redis::reconnector::Run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (!m_stop)
+	{
+		if (!m_pending)
+		{
+			m_wake.wait(lock);
+			continue;
+		}
+
+		if (std::chrono::steady_clock::now() < m_due)
+		{
+			m_wake.wait_until(lock, m_due);
+			continue;
+		}
+
+		uint32_t attempt = ++m_attempts;
+		m_attempting = true;
+		lock.unlock();
+
+		bool connected = m_attempt();
+
+		lock.lock();
+		m_attempting = false;
+		m_wake.notify_all();
+
+		// Cancelled, or connected and already cleared by Connected
+		if (!m_pending || connected)
+			continue;
+
+		connectionEvent event;
+		event.attempt = attempt;
+
+		if (m_policy.maxAttempts < 0 || attempt < static_cast<uint32_t>(m_policy.maxAttempts))
+		{
+			event.retryInMs = NextDelay(attempt);
+			m_due = std::chrono::steady_clock::now() + std::chrono::milliseconds(event.retryInMs);
+		}
+		else
+		{
+			m_pending = false;
+			m_attempts = 0;
+		}
+
+		lock.unlock();
+		m_failed(event);
+		lock.lock();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace redis
+{
+	struct reconnectPolicy {
+		uint32_t	baseMs = 250;
+		uint32_t	maxMs = 30000;
+		int32_t		maxAttempts = -1;	// -1 retries forever
+		bool		hold = true;		// Hold commands sent while reconnecting instead of failing them
+		size_t		maxHeld = 10000;
+	};
+
+	// Reported to OnConnected and OnDisconnected
+	struct connectionEvent {
+		uint32_t	attempt = 0;		// Failed attempts so far, or the attempt that reconnected
+		int64_t		retryInMs = -1;		// -1 once it gave up
+	};
+
+	// Retries a dropped connection from a thread of its own, backing off exponentially with jitter
+	// so servers that lost the same Redis don't all come back at the same moment
+	class reconnector
+	{
+	public:
+		// Returns true once connected
+		typedef std::function<bool()> attempt_t;
+		// Runs after every failed attempt
+		typedef std::function<void(const connectionEvent& event)> failed_t;
+
+		reconnector(const attempt_t& attempt, const failed_t& failed);
+		~reconnector();
+
+		void SetPolicy(const reconnectPolicy& policy);
+		reconnectPolicy GetPolicy();
+
+		// Schedules the first attempt after a drop
+		connectionEvent Schedule();
+		// Stops retrying, waiting for an attempt in progress to finish
+		void Cancel();
+		// Stops for good, Schedule does nothing afterwards. Joins the thread, so not from an attempt or failed callback
+		void Stop();
+		// Stops retrying once connected, before anything is told about it so nothing is held anymore
+		// Returns the attempt that reconnected, 0 if none was pending
+		uint32_t Connected();
+
+		bool Pending() const { return m_pending; }
+	private:
+		void Run();
+
+		// Expects m_mutex to be held
+		int64_t NextDelay(uint32_t attempt);
+
+		attempt_t							m_attempt;
+		failed_t							m_failed;
+
+		std::mutex							m_mutex;
+		std::condition_variable				m_wake;
+		std::thread							m_thread;
+		reconnectPolicy						m_policy;
+		std::mt19937						m_random;
+
+		std::atomic<bool>					m_pending{ false };
+		std::atomic<uint32_t>				m_attempts{ 0 };
+		bool								m_attempting = false;
+		bool								m_stop = false;
+		std::chrono::steady_clock::time_point	m_due;
+	};
+};
\ No newline at end of file
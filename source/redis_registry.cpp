@@ -0,0 +1,82 @@
+#include "main.hpp"
+#include <algorithm>
+#include <mutex>
+#include <unordered_set>
+
+redis::registered* redis::registered::heads[static_cast<size_t>(interfaceKind::Count)] = {};
+redis::registered* redis::registered::tails[static_cast<size_t>(interfaceKind::Count)] = {};
+size_t redis::registered::counts[static_cast<size_t>(interfaceKind::Count)] = {};
+uint32_t redis::registered::nextId = 1;
+
+static std::atomic<bool> anyReady{ false };
+static std::mutex readyMutex;
+static std::vector<uint32_t> readyIds;
+
+redis::registered::registered(interfaceKind kind)
+	: m_id(nextId++), m_kind(kind)
+{
+	registered*& tail = tails[static_cast<size_t>(kind)];
+
+	m_prev = tail;
+	if (tail != nullptr)
+		tail->m_next = this;
+	else
+		heads[static_cast<size_t>(kind)] = this;
+
+	tail = this;
+	counts[static_cast<size_t>(kind)]++;
+}
+
+redis::registered::~registered()
+{
+	if (m_prev != nullptr)
+		m_prev->m_next = m_next;
+	else
+		heads[static_cast<size_t>(m_kind)] = m_next;
+
+	if (m_next != nullptr)
+		m_next->m_prev = m_prev;
+	else
+		tails[static_cast<size_t>(m_kind)] = m_prev;
+
+	counts[static_cast<size_t>(m_kind)]--;
+}
+
+void redis::registered::PushObject(GarrysMod::Lua::ILuaBase* LUA) const
+{
+	LUA->ReferencePush(globals::iRefInterfaces);
+	LUA->PushNumber(m_id);
+	LUA->GetTable(-2);
+	LUA->Remove(-2);
+}
+
+void redis::MarkReady(uint32_t id)
+{
+	std::lock_guard<std::mutex> lock(readyMutex);
+	readyIds.push_back(id);
+	anyReady.store(true, std::memory_order_release);
+}
+
+bool redis::TakeReady(std::vector<uint32_t>& ids)
+{
+	ids.clear();
+	if (!anyReady.load(std::memory_order_acquire))
+		return false;
+
+	// Handed over without copying
+	{
+		std::lock_guard<std::mutex> lock(readyMutex);
+		ids.swap(readyIds);
+		anyReady.store(false, std::memory_order_relaxed);
+	}
+
+	// A direct Poll clears the flag but leaves the id listed, so the next Wake lists it again
+	// Keeps the first of each so budgeted PollAll calls still take them in order
+	if (ids.size() > 1)
+	{
+		std::unordered_set<uint32_t> seen;
+		ids.erase(std::remove_if(ids.begin(), ids.end(), [&seen](uint32_t id) { return !seen.insert(id).second; }), ids.end());
+	}
+
+	return !ids.empty();
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace redis
+{
+	enum class interfaceKind : uint8_t {
+		Client,
+		Subscriber,
+		Consumer,
+		Count
+	};
+
+	// Every live client, subscriber and consumer, linked through themselves so registering and unregistering are O(1)
+	// They are created and destroyed on the Lua thread, the only one that walks the lists
+	class registered
+	{
+	public:
+		registered(interfaceKind kind);
+		virtual ~registered();
+
+		registered(const registered&) = delete;
+		registered& operator=(const registered&) = delete;
+
+		uint32_t Id() const { return m_id; }
+		interfaceKind Kind() const { return m_kind; }
+		registered* Next() const { return m_next; }
+
+		virtual bool IsConnected() const = 0;
+
+		// Called every round of shutdown until it returns true, between Polls that deliver the replies
+		virtual bool Drain() { return true; }
+		// Called once shutdown stops waiting, before a last round of Polls. Fails whatever can't be sent anymore
+		virtual void Abandon() { }
+
+		// Pushes the interface's Lua object, nil once it was collected
+		void PushObject(GarrysMod::Lua::ILuaBase* LUA) const;
+
+		static registered* First(interfaceKind kind) { return heads[static_cast<size_t>(kind)]; }
+		static size_t Count(interfaceKind kind) { return counts[static_cast<size_t>(kind)]; }
+	private:
+		static registered*	heads[static_cast<size_t>(interfaceKind::Count)];
+		static registered*	tails[static_cast<size_t>(interfaceKind::Count)];	// New ones go last, so lists are in creation order
+		static size_t		counts[static_cast<size_t>(interfaceKind::Count)];
+		static uint32_t		nextId;
+
+		registered*			m_prev = nullptr;
+		registered*			m_next = nullptr;
+		uint32_t			m_id;
+		interfaceKind		m_kind;
+	};
+
+	// Interfaces with something for their next Poll, by id, so PollAll only visits those
+	// MarkReady is safe from any thread, TakeReady is for the Lua thread and returns false without locking when none are
+	void MarkReady(uint32_t id);
+	bool TakeReady(std::vector<uint32_t>& ids);
+};
\ No newline at end of file
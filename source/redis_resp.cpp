@@ -0,0 +1,325 @@
+#include "main.hpp"
+#include "redis_resp.h"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define REDIS_RESP_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Deeper replies are malformed or hostile, Lua would overflow pushing them anyway
+static constexpr size_t maxDepth = 128;
+
+static constexpr size_t npos = static_cast<size_t>(-1);
+
+#ifdef REDIS_RESP_SSE2
+static unsigned int LowestBit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// Index of the \r ending the line that starts at from, npos if it hasn't been received yet
+static size_t FindLineEnd(const char* data, size_t from, size_t size)
+{
+#ifdef REDIS_RESP_SSE2
+	const __m128i cr = _mm_set1_epi8('\r');
+	for (; from + 16 <= size; from += 16)
+	{
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + from)), cr));
+		for (; mask != 0; mask &= mask - 1)
+		{
+			size_t at = from + LowestBit(mask);
+			if (at + 1 >= size)
+				return npos;
+
+			if (data[at + 1] == '\n')
+				return at;
+		}
+	}
+#endif
+
+	for (; from + 1 < size; ++from)
+		if (data[from] == '\r' && data[from + 1] == '\n')
+			return from;
+
+	return npos;
+}
+
+static int64_t ParseInteger(const char* begin, const char* end)
+{
+	bool negative = begin != end && *begin == '-';
+	if (negative || (begin != end && *begin == '+'))
+		++begin;
+
+	if (begin == end || end - begin > 19)
+		throw std::runtime_error("Protocol error, invalid integer");
+
+	uint64_t value = 0;
+	for (; begin != end; ++begin)
+	{
+		if (*begin < '0' || *begin > '9')
+			throw std::runtime_error("Protocol error, invalid integer");
+
+		value = value * 10 + (*begin - '0');
+	}
+
+	if (value > static_cast<uint64_t>(INT64_MAX) + negative)
+		throw std::runtime_error("Protocol error, integer out of range");
+
+	return negative ? static_cast<int64_t>(0 - value) : static_cast<int64_t>(value);
+}
+
+static uint32_t ParseSize(const char* begin, const char* end)
+{
+	int64_t size = ParseInteger(begin, end);
+	if (size < 0 || size > UINT32_MAX)
+		throw std::runtime_error("Protocol error, invalid length");
+
+	return static_cast<uint32_t>(size);
+}
+
+size_t redis::resp::Skip(const std::vector<node>& nodes, size_t index)
+{
+	size_t remaining = 1;
+	while (remaining > 0)
+	{
+		const node& value = nodes[index++];
+		--remaining;
+
+		switch (value.type)
+		{
+		case nodeType::Array:
+		case nodeType::Set:
+		case nodeType::Push:
+			remaining += value.size;
+			break;
+
+		case nodeType::Map:
+			remaining += static_cast<size_t>(value.size) * 2;
+			break;
+
+		case nodeType::Attribute:
+			remaining += static_cast<size_t>(value.size) * 2 + 1;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return index;
+}
+
+static cpp_redis::reply ToReply(const redis::resp::frame& frame, size_t& index)
+{
+	using redis::resp::nodeType;
+
+	const redis::resp::node& value = frame.nodes[index++];
+	switch (value.type)
+	{
+	case nodeType::Simple:
+		return cpp_redis::reply(frame.String(value), cpp_redis::reply::string_type::simple_string);
+
+	case nodeType::Error:
+		return cpp_redis::reply(frame.String(value), cpp_redis::reply::string_type::error);
+
+	case nodeType::Bulk:
+	case nodeType::Double:
+	case nodeType::BigNumber:
+		return cpp_redis::reply(frame.String(value), cpp_redis::reply::string_type::bulk_string);
+
+	case nodeType::Integer:
+		return cpp_redis::reply(value.integer);
+
+	case nodeType::Boolean:
+		return cpp_redis::reply(static_cast<int64_t>(value.boolean));
+
+	case nodeType::Attribute:
+		for (size_t i = 0; i < static_cast<size_t>(value.size) * 2; ++i)
+			index = redis::resp::Skip(frame.nodes, index);
+
+		return ToReply(frame, index);
+
+	case nodeType::Null:
+		return cpp_redis::reply();
+
+	default:
+	{
+		// Maps flatten into field, value arrays the way RESP2 sends them
+		size_t count = value.type == nodeType::Map ? static_cast<size_t>(value.size) * 2 : value.size;
+
+		std::vector<cpp_redis::reply> rows;
+		rows.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+			rows.push_back(ToReply(frame, index));
+
+		return cpp_redis::reply(rows);
+	}
+	}
+}
+
+cpp_redis::reply redis::resp::ToReply(const frame& frame)
+{
+	size_t index = 0;
+	return ::ToReply(frame, index);
+}
+
+bool redis::resp::parser::Parse(const char* data, size_t size)
+{
+	while (m_pos < size)
+	{
+		size_t lineEnd = FindLineEnd(data, m_pos + 1, size);
+		if (lineEnd == npos)
+			return false;
+
+		const char* line = data + m_pos + 1;
+		const char* end = data + lineEnd;
+		size_t next = lineEnd + 2;
+
+		node value;
+		size_t children = 0;
+		switch (data[m_pos])
+		{
+		case '+':
+		case '-':
+			value.type = data[m_pos] == '+' ? nodeType::Simple : nodeType::Error;
+			value.offset = m_pos + 1;
+			value.size = static_cast<uint32_t>(lineEnd - m_pos - 1);
+			break;
+
+		case ',':
+		case '(':
+			value.type = data[m_pos] == ',' ? nodeType::Double : nodeType::BigNumber;
+			value.offset = m_pos + 1;
+			value.size = static_cast<uint32_t>(lineEnd - m_pos - 1);
+			break;
+
+		case ':':
+			value.type = nodeType::Integer;
+			value.integer = ParseInteger(line, end);
+			break;
+
+		case '#':
+			if (end - line != 1 || (*line != 't' && *line != 'f'))
+				throw std::runtime_error("Protocol error, invalid boolean");
+
+			value.type = nodeType::Boolean;
+			value.boolean = *line == 't';
+			break;
+
+		case '_':
+			value.type = nodeType::Null;
+			break;
+
+		case '$':
+		case '=':
+		case '!':
+		{
+			if (end - line == 2 && line[0] == '-' && line[1] == '1')
+			{
+				value.type = nodeType::Null;
+				break;
+			}
+
+			uint32_t length = ParseSize(line, end);
+			if (size - next < static_cast<size_t>(length) + 2)
+				return false;
+
+			if (data[next + length] != '\r' || data[next + length + 1] != '\n')
+				throw std::runtime_error("Protocol error, bulk string length mismatch");
+
+			value.type = data[m_pos] == '!' ? nodeType::Error : nodeType::Bulk;
+			value.offset = next;
+			value.size = length;
+
+			// Verbatim strings start with their format, "txt:" or "mkd:"
+			if (data[m_pos] == '=')
+			{
+				if (length < 4 || data[next + 3] != ':')
+					throw std::runtime_error("Protocol error, invalid verbatim string");
+
+				value.offset += 4;
+				value.size -= 4;
+			}
+
+			next += static_cast<size_t>(length) + 2;
+			break;
+		}
+
+		case '*':
+		case '~':
+		case '>':
+		case '%':
+		case '|':
+		{
+			if (end - line == 2 && line[0] == '-' && line[1] == '1')
+			{
+				value.type = nodeType::Null;
+				break;
+			}
+
+			value.size = ParseSize(line, end);
+			children = value.size;
+
+			switch (data[m_pos])
+			{
+			case '*': value.type = nodeType::Array; break;
+			case '~': value.type = nodeType::Set; break;
+			case '>': value.type = nodeType::Push; break;
+			case '%': value.type = nodeType::Map; children *= 2; break;
+			default: value.type = nodeType::Attribute; children = children * 2 + 1; break;
+			}
+			break;
+		}
+
+		default:
+			throw std::runtime_error("Protocol error, unknown reply type");
+		}
+
+		m_nodes.push_back(value);
+		m_pos = next;
+
+		if (children > 0)
+		{
+			if (m_open.size() >= maxDepth)
+				throw std::runtime_error("Protocol error, reply nested too deeply");
+
+			m_open.push_back(children);
+			continue;
+		}
+
+		// A complete value finishes every aggregate it was the last child of
+		while (!m_open.empty() && --m_open.back() == 0)
+			m_open.pop_back();
+
+		if (m_open.empty())
+			return true;
+	}
+
+	return false;
+}
+
+void redis::resp::parser::Take(std::vector<node>& nodes)
+{
+	nodes.swap(m_nodes);
+	Reset();
+}
+
+void redis::resp::parser::Reset()
+{
+	m_pos = 0;
+	m_open.clear();
+	m_nodes.clear();
+}
\ No newline at end of file
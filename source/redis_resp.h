@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace redis
+{
+	// https://redis.io/docs/reference/protocol-spec/
+	namespace resp
+	{
+		enum class nodeType : uint8_t {
+			Simple,
+			Error,
+			Integer,
+			Bulk,		// Also verbatim strings, without their format prefix
+			Null,
+			Double,		// RESP3, kept as text
+			Boolean,	// RESP3
+			BigNumber,	// RESP3, kept as text
+			Array,		// Followed by size values, every type from here on is an aggregate
+			Set,		// RESP3, followed by size values
+			Push,		// RESP3, followed by size values
+			Map,		// RESP3, followed by size key, value pairs
+			Attribute	// RESP3, followed by size key, value pairs and then the value they describe
+		};
+
+		// One value of a reply, strings point back into the frame instead of being copied
+		struct node {
+			nodeType	type;
+			uint32_t	size = 0;	// Bytes of strings, children of aggregates
+			union {
+				int64_t	integer;
+				bool	boolean;
+				size_t	offset;		// Strings, doubles and big numbers
+			};
+		};
+
+		// A complete reply, nodes[0] being its outermost value
+		struct frame {
+			std::string			data;
+			std::vector<node>	nodes;
+
+			const char* At(const node& value) const { return data.data() + value.offset; }
+			std::string String(const node& value) const { return std::string(At(value), value.size); }
+		};
+
+		// Returns the index after the value at index and everything inside it
+		size_t Skip(const std::vector<node>& nodes, size_t index);
+
+		// Builds the cpp_redis reply RESP2 would have sent, for code that still works on those
+		cpp_redis::reply ToReply(const frame& frame);
+
+		// Incremental, a reply split across reads is picked up where the last call stopped
+		class parser
+		{
+		public:
+			// data holds the frame from its first byte, including everything passed to earlier calls
+			// Returns true once the frame is complete, throws std::runtime_error on malformed replies
+			bool Parse(const char* data, size_t size);
+
+			// Bytes of the completed frame
+			size_t Size() const { return m_pos; }
+
+			// Moves the completed frame's nodes out and starts on the next frame
+			void Take(std::vector<node>& nodes);
+			void Reset();
+		private:
+			size_t					m_pos = 0;
+			std::vector<size_t>		m_open;		// Children still expected by every aggregate that isn't complete
+			std::vector<node>		m_nodes;
+		};
+	};
+};
\ No newline at end of file
@@ -0,0 +1,441 @@
+#include "main.hpp"
+#include "redis_shards.h"
+#include <algorithm>
+
+static constexpr size_t slotCount = 16384;
+
+static uint16_t crc16(const char* data, size_t len)
+{
+	uint16_t crc = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		crc ^= static_cast<uint16_t>(static_cast<uint8_t>(data[i])) << 8;
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+	}
+
+	return crc;
+}
+
+uint16_t redis::KeySlot(const std::string& key)
+{
+	// Only the part between the first {} is hashed, if it isn't empty
+	size_t open = key.find('{');
+	if (open != std::string::npos)
+	{
+		size_t close = key.find('}', open + 1);
+		if (close != std::string::npos && close != open + 1)
+			return crc16(key.data() + open + 1, close - open - 1) % slotCount;
+	}
+
+	return crc16(key.data(), key.size()) % slotCount;
+}
+
+redis::shardRouter::shardRouter(const std::shared_ptr<transport>& parent, const std::string& host, size_t port, uint32_t timeoutMs, const messageHandler_t& onMessage, const wakeHandler_t& wake)
+	: m_parent(parent), m_host(host), m_port(port), m_timeoutMs(timeoutMs), m_onMessage(onMessage), m_wake(wake)
+{
+}
+
+redis::shardRouter::~shardRouter()
+{
+	std::unordered_map<std::string, connection_t> connections;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		connections = std::move(m_connections);
+	}
+
+	for (auto& connection : connections)
+		connection.second->disconnect(true);
+
+	if (m_seed)
+		m_seed->disconnect(true);
+}
+
+const std::string& redis::shardRouter::Owner(const std::string& channel) const
+{
+	return m_nodes[m_slots[KeySlot(channel)]];
+}
+
+redis::shardRouter::connection_t redis::shardRouter::Open(const std::string& node)
+{
+	size_t colon = node.rfind(':');
+	std::string host = node.substr(0, colon);
+	size_t port = std::stoul(node.substr(colon + 1));
+
+	connection_t connection(new cpp_redis::network::redis_connection(m_parent->Sibling()));
+	connection->connect(host, port,
+		[this, node](cpp_redis::network::redis_connection&)
+		{
+			OnNodeLost(node);
+		},
+		[this](cpp_redis::network::redis_connection&, cpp_redis::reply& reply)
+		{
+			OnReply(reply);
+		}, m_timeoutMs);
+
+	return connection;
+}
+
+void redis::shardRouter::ConnectOwners(std::unique_lock<std::mutex>& lock, const std::vector<std::string>& channels)
+{
+	std::vector<std::string> missing;
+	for (const std::string& channel : channels)
+	{
+		const std::string& owner = Owner(channel);
+		auto existing = m_connections.find(owner);
+		if ((existing == m_connections.end() || !existing->second->is_connected()) && std::find(missing.begin(), missing.end(), owner) == missing.end())
+			missing.push_back(owner);
+	}
+
+	if (missing.empty())
+		return;
+
+	lock.unlock();
+
+	std::vector<std::pair<std::string, connection_t>> opened;
+	for (const std::string& node : missing)
+	{
+		try
+		{
+			opened.emplace_back(node, Open(node));
+		}
+		catch (const cpp_redis::redis_error&)
+		{
+			// Route tries again and reports it
+		}
+	}
+
+	lock.lock();
+
+	for (auto& connection : opened)
+	{
+		connection_t& current = m_connections[connection.first];
+
+		// Connected by someone else meanwhile
+		if (current && current->is_connected())
+		{
+			m_closed.push_back(std::move(connection.second));
+			continue;
+		}
+
+		if (current)
+			m_closed.push_back(std::move(current));
+
+		current = std::move(connection.second);
+	}
+}
+
+cpp_redis::network::redis_connection& redis::shardRouter::Connection(const std::string& node)
+{
+	auto existing = m_connections.find(node);
+	if (existing != m_connections.end())
+	{
+		if (existing->second->is_connected())
+			return *existing->second;
+
+		m_closed.push_back(std::move(existing->second));
+		m_connections.erase(existing);
+	}
+
+	connection_t connection = Open(node);
+	cpp_redis::network::redis_connection& ref = *connection;
+	m_connections.emplace(node, std::move(connection));
+	return ref;
+}
+
+void redis::shardRouter::Route(const std::string& channel, std::vector<cpp_redis::network::redis_connection*>& touched)
+{
+	const std::string& owner = Owner(channel);
+	std::string& current = m_channels[channel];
+
+	auto existing = m_connections.find(current);
+	bool alive = existing != m_connections.end() && existing->second->is_connected();
+	if (current == owner && alive)
+		return;
+
+	if (alive)
+	{
+		existing->second->send({ "SUNSUBSCRIBE", channel });
+		touched.push_back(existing->second.get());
+	}
+
+	current.clear();
+
+	cpp_redis::network::redis_connection& connection = Connection(owner);
+	connection.send({ "SSUBSCRIBE", channel });
+	touched.push_back(&connection);
+
+	current = owner;
+}
+
+static void CommitAll(std::vector<cpp_redis::network::redis_connection*>& touched)
+{
+	std::sort(touched.begin(), touched.end());
+	touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+
+	for (cpp_redis::network::redis_connection* connection : touched)
+	{
+		try
+		{
+			connection->commit();
+		}
+		catch (const cpp_redis::redis_error&)
+		{
+			// Its disconnection handler flags the channels for a refresh
+		}
+	}
+}
+
+void redis::shardRouter::OnSlots(const cpp_redis::reply& reply)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_nodes.clear();
+	m_slots.assign(slotCount, 0);
+
+	// CLUSTER SLOTS replies [[start, end, [host, port, ...], replicas...], ...]
+	if (reply.is_array())
+		for (const cpp_redis::reply& range : reply.as_array())
+		{
+			if (!range.is_array() || range.as_array().size() < 3)
+				continue;
+
+			const std::vector<cpp_redis::reply>& info = range.as_array();
+			if (!info[0].is_integer() || !info[1].is_integer() || !info[2].is_array() || info[2].as_array().size() < 2)
+				continue;
+
+			const std::vector<cpp_redis::reply>& master = info[2].as_array();
+			if (!master[0].is_string() || !master[1].is_integer())
+				continue;
+
+			// An empty host means the node is reached the same way as the one we asked
+			std::string node = (master[0].as_string().empty() ? m_host : master[0].as_string()) + ":" + std::to_string(master[1].as_integer());
+
+			auto known = std::find(m_nodes.begin(), m_nodes.end(), node);
+			uint16_t index = static_cast<uint16_t>(known - m_nodes.begin());
+			if (known == m_nodes.end())
+				m_nodes.push_back(node);
+
+			int64_t last = std::min<int64_t>(info[1].as_integer(), slotCount - 1);
+			for (int64_t slot = std::max<int64_t>(info[0].as_integer(), 0); slot <= last; ++slot)
+				m_slots[static_cast<size_t>(slot)] = index;
+		}
+
+	// Not a cluster, everything lives on the node we asked
+	if (m_nodes.empty())
+		m_nodes.push_back(m_host + ":" + std::to_string(m_port));
+
+	m_refreshing = false;
+	m_needsRefresh = false;
+	m_needsReroute = true;
+
+	lock.unlock();
+	m_wake();
+}
+
+void redis::shardRouter::Reroute()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_needsReroute = false;
+
+	std::vector<std::string> channels;
+	channels.reserve(m_channels.size());
+	for (auto& channel : m_channels)
+		channels.push_back(channel.first);
+
+	ConnectOwners(lock, channels);
+
+	// Channels unsubscribed while connecting are gone from m_channels
+	std::vector<cpp_redis::network::redis_connection*> touched;
+	for (const std::string& channel : channels)
+	{
+		if (m_channels.find(channel) == m_channels.end())
+			continue;
+
+		try
+		{
+			Route(channel, touched);
+		}
+		catch (const cpp_redis::redis_error&)
+		{
+			m_needsRefresh = true;
+		}
+	}
+
+	CommitAll(touched);
+}
+
+void redis::shardRouter::OnReply(const cpp_redis::reply& reply)
+{
+	if (reply.is_error())
+	{
+		// The slot moved since the map was fetched
+		if (reply.as_string().compare(0, 5, "MOVED") == 0)
+			m_needsRefresh = true,
+			m_wake();
+
+		return;
+	}
+
+	if (!reply.is_array() || reply.as_array().size() != 3)
+		return;
+
+	const std::vector<cpp_redis::reply>& push = reply.as_array();
+	if (push[0].is_string() && push[0].as_string() == "smessage" && push[1].is_string() && push[2].is_string())
+		m_onMessage(push[1].as_string(), push[2].as_string());
+}
+
+void redis::shardRouter::OnNodeLost(const std::string& node)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		for (auto& channel : m_channels)
+			if (channel.second == node)
+				channel.second.clear();
+
+		m_needsRefresh = true;
+	}
+
+	m_wake();
+}
+
+void redis::shardRouter::OnSeedLost(cpp_redis::network::redis_connection& seed)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Dropped before the slot map arrived, the next Poll asks again
+		if (!m_refreshing || m_seed.get() != &seed)
+			return;
+
+		m_refreshing = false;
+		m_needsRefresh = true;
+	}
+
+	m_wake();
+}
+
+void redis::shardRouter::Refresh()
+{
+	std::vector<connection_t> closed;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Destroyed without the lock, their disconnection handlers take it
+		closed.swap(m_closed);
+		if (m_refreshing)
+			return;
+
+		// Its reply callback may still be unwinding, so it is destroyed on the next refresh instead
+		if (m_seed)
+			m_closed.push_back(std::move(m_seed));
+
+		m_refreshing = true;
+		m_needsRefresh = false;
+	}
+
+	closed.clear();
+
+	connection_t seed;
+	try
+	{
+		seed.reset(new cpp_redis::network::redis_connection(m_parent->Sibling()));
+		seed->connect(m_host, m_port, [this](cpp_redis::network::redis_connection& lost)
+			{
+				OnSeedLost(lost);
+			}, [this](cpp_redis::network::redis_connection&, cpp_redis::reply& reply)
+			{
+				OnSlots(reply);
+			}, m_timeoutMs);
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_refreshing = false;
+		m_needsRefresh = true;
+		throw;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_seed = std::move(seed);
+
+	try
+	{
+		// Dropped before it was m_seed, so OnSeedLost didn't recognize it
+		if (!m_seed->is_connected())
+			throw cpp_redis::redis_error("Lost the connection to the cluster");
+
+		m_seed->send({ "CLUSTER", "SLOTS" });
+		m_seed->commit();
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		m_refreshing = false;
+		m_needsRefresh = true;
+		throw;
+	}
+}
+
+void redis::shardRouter::Subscribe(const std::vector<std::string>& channels)
+{
+	bool refresh = false;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		for (const std::string& channel : channels)
+			m_channels.emplace(channel, std::string());
+
+		// Subscribed once the slot map arrives
+		if (m_nodes.empty())
+			refresh = !m_refreshing;
+		else
+		{
+			ConnectOwners(lock, channels);
+
+			std::vector<cpp_redis::network::redis_connection*> touched;
+			try
+			{
+				for (const std::string& channel : channels)
+					if (m_channels.find(channel) != m_channels.end())
+						Route(channel, touched);
+			}
+			catch (const cpp_redis::redis_error&)
+			{
+				CommitAll(touched);
+				m_needsRefresh = true;
+				throw;
+			}
+
+			CommitAll(touched);
+		}
+	}
+
+	if (refresh)
+		Refresh();
+}
+
+void redis::shardRouter::Unsubscribe(const std::vector<std::string>& channels)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::vector<cpp_redis::network::redis_connection*> touched;
+	for (const std::string& channel : channels)
+	{
+		auto subscribed = m_channels.find(channel);
+		if (subscribed == m_channels.end())
+			continue;
+
+		auto connection = m_connections.find(subscribed->second);
+		if (connection != m_connections.end() && connection->second->is_connected())
+		{
+			connection->second->send({ "SUNSUBSCRIBE", channel });
+			touched.push_back(connection->second.get());
+		}
+
+		m_channels.erase(subscribed);
+	}
+
+	CommitAll(touched);
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace redis
+{
+	class transport;
+
+	// https://redis.io/docs/reference/cluster-spec/#key-distribution-model
+	uint16_t KeySlot(const std::string& key);
+
+	// Keeps one connection per cluster node and subscribes every shard channel on the node that owns its slot
+	class shardRouter
+	{
+	public:
+		typedef std::function<void(const std::string& channel, const std::string& message)> messageHandler_t;
+		// Network thread, whenever NeedsRefresh or NeedsReroute turns true
+		typedef std::function<void()> wakeHandler_t;
+
+		// Every connection gets a sibling of parent, so it has the same TLS, AUTH and socket backend
+		shardRouter(const std::shared_ptr<transport>& parent, const std::string& host, size_t port, uint32_t timeoutMs, const messageHandler_t& onMessage, const wakeHandler_t& wake);
+		~shardRouter();
+
+		// Throw cpp_redis::redis_error if a node can't be reached
+		void Subscribe(const std::vector<std::string>& channels);
+		void Unsubscribe(const std::vector<std::string>& channels);
+
+		// Lua thread, both connect so they're kept off the network thread
+		// Fetches the slot map again, Reroute then moves channels whose node changed or was lost
+		void Refresh();
+		bool NeedsRefresh() const { return m_needsRefresh; }
+		void Reroute();
+		bool NeedsReroute() const { return m_needsReroute; }
+	private:
+		typedef std::unique_ptr<cpp_redis::network::redis_connection> connection_t;
+
+		void OnSlots(const cpp_redis::reply& reply);
+		void OnReply(const cpp_redis::reply& reply);
+		void OnNodeLost(const std::string& node);
+		void OnSeedLost(cpp_redis::network::redis_connection& seed);
+
+		// Blocks until connected, throws cpp_redis::redis_error
+		connection_t Open(const std::string& node);
+
+		// Connects to the nodes owning channels that have no live connection, unlocking m_mutex meanwhile
+		void ConnectOwners(std::unique_lock<std::mutex>& lock, const std::vector<std::string>& channels);
+
+		// The rest expect m_mutex to be held
+		const std::string& Owner(const std::string& channel) const;
+		cpp_redis::network::redis_connection& Connection(const std::string& node);
+		void Route(const std::string& channel, std::vector<cpp_redis::network::redis_connection*>& touched);
+
+		std::shared_ptr<transport>			m_parent;
+		std::string							m_host;
+		size_t								m_port;
+		uint32_t							m_timeoutMs;
+		messageHandler_t					m_onMessage;
+
+		std::mutex							m_mutex;
+		std::vector<std::string>			m_nodes;		// "host:port"
+		std::vector<uint16_t>				m_slots;		// Index into m_nodes for every slot
+		std::unordered_map<std::string, connection_t>	m_connections;
+		std::unordered_map<std::string, std::string>	m_channels;	// Channel to the node it is subscribed on, empty while it is not
+
+		connection_t						m_seed;
+		std::vector<connection_t>			m_closed;		// Destroyed from the Lua thread, never inside their own callbacks
+		bool								m_refreshing = false;
+		std::atomic<bool>					m_needsRefresh{ false };
+		std::atomic<bool>					m_needsReroute{ false };	// A new slot map arrived
+		wakeHandler_t						m_wake;
+	};
+};
\ No newline at end of file
@@ -20,25 +20,291 @@ void redis::subscriber::Initialize(GarrysMod::Lua::ILuaBase* LUA)
 	LUA->PushCFunction(wrap(lua_PUnsubscribe));
 	LUA->SetField(-2, "PUnsubscribe");
 
+	LUA->PushCFunction(wrap(lua_SSubscribe));
+	LUA->SetField(-2, "SSubscribe");
+
+	LUA->PushCFunction(wrap(lua_SUnsubscribe));
+	LUA->SetField(-2, "SUnsubscribe");
+
 	LUA->Pop();
 }
 
-void redis::subscriber::HandleAction(GarrysMod::Lua::ILuaBase* LUA, subAction action)
+// Channels matched by patterns are interned too, up to this many names. Past it messages carry the name themselves
+static constexpr size_t maxMatched = 4096;
+
+// How often the cluster slot map may be fetched again after a node is lost or a slot moves
+static constexpr std::chrono::seconds shardRefreshInterval(1);
+
+redis::subscriber::~subscriber()
+{
+	m_shards.reset();
+	m_iface.disconnect(true);
+}
+
+void redis::subscriber::ReleaseReferences(GarrysMod::Lua::ILuaBase* LUA)
+{
+	BaseInterface::ReleaseReferences(LUA);
+
+	std::lock_guard<std::mutex> lock(m_namesMutex);
+	for (nameTable* names : { &m_channels, &m_patterns, &m_shardChannels, &m_matched })
+		for (auto& name : *names)
+		{
+			if (name.second->reference > 0)
+				LUA->ReferenceFree(name.second->reference);
+
+			if (name.second->callback > 0)
+				LUA->ReferenceFree(name.second->callback);
+
+			name.second->reference = name.second->callback = 0;
+		}
+}
+
+bool redis::subscriber::PollPending(GarrysMod::Lua::ILuaBase* LUA)
+{
+	if (!m_shards)
+		return false;
+
+	// Connects to the nodes of a new slot map here rather than on the network thread that received it
+	if (m_shards->NeedsReroute())
+		m_shards->Reroute();
+
+	if (!m_shards->NeedsRefresh())
+		return false;
+
+	auto now = std::chrono::steady_clock::now();
+	if (now < m_nextShardRefresh)
+		return false;
+
+	m_nextShardRefresh = now + shardRefreshInterval;
+
+	try
+	{
+		m_shards->Refresh();
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		// Tried again on a later Poll
+	}
+
+	return false;
+}
+
+internedName* redis::subscriber::Intern(nameTable& names, const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(m_namesMutex);
+
+	auto interned = names.find(name);
+	if (interned != names.end())
+		return interned->second.get();
+
+	internedName* entry = new internedName{ name, &names };
+	names.emplace(name, std::unique_ptr<internedName>(entry));
+	return entry;
+}
+
+internedName* redis::subscriber::Find(nameTable& names, const std::string& name)
 {
-	if (action.type == redis::globals::actionType::Message)
+	std::lock_guard<std::mutex> lock(m_namesMutex);
+
+	auto interned = names.find(name);
+	return interned != names.end() ? interned->second.get() : nullptr;
+}
+
+internedName* redis::subscriber::Acquire(nameTable& names, const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(m_namesMutex);
+
+	auto interned = names.find(name);
+	if (interned == names.end())
+		return nullptr;
+
+	++interned->second->pending;
+	return interned->second.get();
+}
+
+internedName* redis::subscriber::AcquireMatched(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(m_namesMutex);
+
+	internedName* entry;
+	auto interned = m_matched.find(name);
+	if (interned != m_matched.end())
 	{
+		entry = interned->second.get();
+		if (entry->pending == 0)
+			m_idleMatched.erase(entry->idle);
+	}
+	else
+	{
+		// Idle names are only evicted on the Lua thread, which owns their references
+		if (m_matched.size() >= maxMatched)
+			return nullptr;
+
+		entry = new internedName{ name, &m_matched };
+		m_matched.emplace(name, std::unique_ptr<internedName>(entry));
+	}
+
+	++entry->pending;
+	return entry;
+}
+
+void redis::subscriber::Release(GarrysMod::Lua::ILuaBase* LUA, internedName* entry)
+{
+	if (entry == nullptr)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_namesMutex);
+
+	if (--entry->pending > 0)
+		return;
+
+	if (entry->table != &m_matched)
+	{
+		if (!entry->subscribed)
+			Forget(LUA, entry);
+
+		return;
+	}
+
+	entry->idle = m_idleMatched.insert(m_idleMatched.end(), entry);
+
+	// Room is made for the next one on the network thread
+	while (m_matched.size() >= maxMatched && !m_idleMatched.empty())
+	{
+		internedName* oldest = m_idleMatched.front();
+		m_idleMatched.pop_front();
+		Forget(LUA, oldest);
+	}
+}
+
+void redis::subscriber::Unsubscribed(GarrysMod::Lua::ILuaBase* LUA, internedName* entry)
+{
+	if (entry == nullptr)
+		return;
+
+	RemoveCallback(LUA, entry);
+
+	std::lock_guard<std::mutex> lock(m_namesMutex);
+
+	entry->subscribed = false;
+	if (entry->pending == 0)
+		Forget(LUA, entry);
+}
+
+void redis::subscriber::Forget(GarrysMod::Lua::ILuaBase* LUA, internedName* entry)
+{
+	if (entry->reference > 0)
+		LUA->ReferenceFree(entry->reference);
+
+	if (entry->callback > 0)
+		LUA->ReferenceFree(entry->callback);
+
+	entry->table->erase(entry->table->find(entry->name));
+}
+
+void redis::subscriber::EnqueueMessage(internedName* channel, const std::string& rawChannel, const std::string& message, internedName* pattern)
+{
+	subAction action = { redis::globals::actionType::Message, {channel} };
+	action.data.pattern = pattern;
+
+	if (channel == nullptr)
+		action.data.rawChannel = rawChannel;
+
+	action.data.message = m_messagePool.Take();
+	action.data.message.assign(message);
+
+	EnqueueAction(std::move(action));
+}
+
+void redis::subscriber::PushName(GarrysMod::Lua::ILuaBase* LUA, internedName& name)
+{
+	if (name.reference > 0)
+	{
+		LUA->ReferencePush(name.reference);
+		return;
+	}
+
+	LUA->PushString(name.name.c_str(), name.name.size());
+	LUA->Push(-1);
+	name.reference = LUA->ReferenceCreate();
+}
+
+void redis::subscriber::HandleAction(GarrysMod::Lua::ILuaBase* LUA, subAction& action)
+{
+	if (action.type == redis::globals::actionType::Reply)
+	{
+		LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
+		LUA->ReferencePush(action.data.reference);
+		LUA->Push(1);
+		LUA->PushNumber(static_cast<double>(action.data.count));
+
+		if (LUA->PCall(2, 0, -4) != 0)
+			redis::ErrorNoHalt(LUA, "[redis Subscribe callback error] ");
+
+		LUA->Pop();
+		LUA->ReferenceFree(action.data.reference);
+	}
+	else if (action.type == redis::globals::actionType::Message)
+	{
+		subActionData& data = action.data;
+
+		// Messages go to the callback given for their channel or pattern, OnMessage gets the rest
+		int callbackRef = 0;
+		if (data.pattern != nullptr)
+			callbackRef = data.pattern->callback;
+		else if (data.channel != nullptr)
+			callbackRef = data.channel->callback;
+
 		LUA->ReferencePush(redis::globals::iRefDebugTraceBack);
-		if (redis::PushCallback(LUA, m_refOnMessage, 1, "OnMessage"))
+		if (callbackRef > 0 || redis::PushCallback(LUA, m_refOnMessage, 1, "OnMessage"))
 		{
+			if (callbackRef > 0)
+				LUA->ReferencePush(callbackRef);
+
 			LUA->Push(1);
-				LUA->PushString(action.data.channel.c_str());
-				LUA->PushString(action.data.message.c_str());
 
-				if (LUA->PCall(3, 0, -5) != 0)
-					redis::ErrorNoHalt(LUA, "[redis OnMessage callback error] ");
+			if (data.channel != nullptr)
+				PushName(LUA, *data.channel);
+			else
+				LUA->PushString(data.rawChannel.c_str(), data.rawChannel.size());
+
+			LUA->PushString(data.message.c_str(), data.message.size());
+
+			if (data.pattern != nullptr)
+				PushName(LUA, *data.pattern);
+			else
+				LUA->PushNil();
+
+			if (LUA->PCall(4, 0, -6) != 0)
+				redis::ErrorNoHalt(LUA, "[redis OnMessage callback error] ");
 		}
-		else
-			LUA->Pop();
+
+		LUA->Pop();
+
+		m_messagePool.Give(std::move(data.message));
+
+		Release(LUA, data.channel);
+		Release(LUA, data.pattern);
+	}
+}
+
+void redis::subscriber::SetCallback(GarrysMod::Lua::ILuaBase* LUA, internedName& name, int stackPos)
+{
+	RemoveCallback(LUA, &name);
+
+	if (LUA->IsType(stackPos, GarrysMod::Lua::Type::FUNCTION))
+	{
+		LUA->Push(stackPos);
+		name.callback = LUA->ReferenceCreate();
+	}
+}
+
+void redis::subscriber::RemoveCallback(GarrysMod::Lua::ILuaBase* LUA, internedName* name)
+{
+	if (name != nullptr && name->callback > 0)
+	{
+		LUA->ReferenceFree(name->callback);
+		name->callback = 0;
 	}
 }
 
@@ -62,45 +328,146 @@ int redis::subscriber::lua_Ping(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/subscribe/
-int redis::subscriber::lua_Subscribe(GarrysMod::Lua::ILuaBase* LUA)
+// Reads a single name or an array of names
+static std::vector<std::string> GetNames(GarrysMod::Lua::ILuaBase* LUA, int stackPos)
 {
-	subscriber* ptr = GetSubscriber(LUA, 1, true);
-	const char* channel = LUA->CheckString(2);
+	std::vector<std::string> names;
+	if (!LUA->IsType(stackPos, GarrysMod::Lua::Type::TABLE))
+	{
+		names.emplace_back(LUA->CheckString(stackPos));
+		return names;
+	}
 
-	try
+	for (int i = 1; ; ++i)
 	{
-		ptr->m_iface.subscribe(channel, [ptr](const std::string& channel, const std::string& message)
+		LUA->PushNumber(i);
+		LUA->GetTable(stackPos);
+		if (!LUA->IsType(-1, GarrysMod::Lua::Type::STRING))
+		{
+			LUA->Pop();
+			break;
+		}
+
+		names.emplace_back(LUA->GetString(-1));
+		LUA->Pop();
+	}
+
+	if (names.empty())
+		LUA->ArgError(stackPos, "expected at least one name");
+
+	return names;
+}
+
+void redis::subscriber::SubscribeName(internedName* entry, bool pattern, const cpp_redis::subscriber::acknowledgement_callback_t& acknowledged)
+{
+	// Entries are looked up again for every message, they may be freed once unsubscribed
+	const std::string& name = entry->name;
+	if (pattern)
+		m_iface.psubscribe(name, [this, name](const std::string& channel, const std::string& message)
 			{
-				ptr->EnqueueAction({ redis::globals::actionType::Message, channel, message });
-			});
+				internedName* pattern = Acquire(m_patterns, name);
+				EnqueueMessage(AcquireMatched(channel), channel, message, pattern);
+			}, acknowledged);
+	else
+		m_iface.subscribe(name, [this](const std::string& channel, const std::string& message)
+			{
+				EnqueueMessage(Acquire(m_channels, channel), channel, message, nullptr);
+			}, acknowledged);
+
+	entry->subscribed = true;
+}
+
+void redis::subscriber::ConnectionChanged(GarrysMod::Lua::ILuaBase* LUA, bool connected, const redis::connectionEvent& event)
+{
+	// cpp_redis forgets its subscriptions once the connection drops
+	if (!connected || event.attempt == 0)
+		return;
+
+	std::vector<std::pair<internedName*, bool>> names;
+	{
+		std::lock_guard<std::mutex> lock(m_namesMutex);
+
+		for (auto& name : m_channels)
+			if (name.second->subscribed)
+				names.emplace_back(name.second.get(), false);
+
+		for (auto& name : m_patterns)
+			if (name.second->subscribed)
+				names.emplace_back(name.second.get(), true);
+	}
+
+	if (names.empty())
+		return;
+
+	try
+	{
+		for (auto& name : names)
+			SubscribeName(name.first, name.second, nullptr);
+
+		m_iface.commit();
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
-		LUA->PushNil();
 		LUA->PushString(e.what());
-		return 2;
+		redis::ErrorNoHalt(LUA, "[redis Resubscribe error] ");
 	}
-
-	LUA->PushBool(true);
-	return 1;
 }
 
-// https://redis.io/commands/psubscribe/
-int redis::subscriber::lua_PSubscribe(GarrysMod::Lua::ILuaBase* LUA)
+int redis::subscriber::Subscribe(GarrysMod::Lua::ILuaBase* LUA, bool patterns)
 {
 	subscriber* ptr = GetSubscriber(LUA, 1, true);
-	const char* channel = LUA->CheckString(2);
+	std::vector<std::string> names = GetNames(LUA, 2);
 
-	try
+	for (int i = 3; i <= 4; ++i)
+		if (LUA->Top() >= i && !LUA->IsType(i, GarrysMod::Lua::Type::NIL))
+			LUA->CheckType(i, GarrysMod::Lua::Type::FUNCTION);
+
+	nameTable& table = patterns ? ptr->m_patterns : ptr->m_channels;
+
+	std::vector<internedName*> interned;
+	interned.reserve(names.size());
+	for (const std::string& name : names)
+		interned.push_back(ptr->Intern(table, name));
+
+	// Every confirmation is counted down, the callback runs once with the final subscription count
+	cpp_redis::subscriber::acknowledgement_callback_t acknowledged = nullptr;
+	int confirmRef = 0;
+	if (LUA->IsType(4, GarrysMod::Lua::Type::FUNCTION))
 	{
-		ptr->m_iface.psubscribe(channel, [ptr](const std::string& channel, const std::string& message)
+		LUA->Push(4);
+		confirmRef = LUA->ReferenceCreate();
+
+		std::shared_ptr<std::atomic<size_t>> remaining = std::make_shared<std::atomic<size_t>>(names.size());
+		acknowledged = [ptr, remaining, confirmRef](int64_t count)
 			{
-				ptr->EnqueueAction({ redis::globals::actionType::Message, channel, message });
-			});
+				if (--*remaining == 0)
+				{
+					subAction action = { redis::globals::actionType::Reply, {nullptr} };
+					action.data.reference = confirmRef;
+					action.data.count = count;
+
+					ptr->EnqueueAction(std::move(action));
+				}
+			};
+	}
+
+	try
+	{
+		for (internedName* entry : interned)
+		{
+			SetCallback(LUA, *entry, 3);
+			ptr->SubscribeName(entry, patterns, acknowledged);
+		}
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
+		if (confirmRef > 0)
+			LUA->ReferenceFree(confirmRef);
+
+		for (internedName* entry : interned)
+			if (!entry->subscribed)
+				ptr->Unsubscribed(LUA, entry);
+
 		LUA->PushNil();
 		LUA->PushString(e.what());
 		return 2;
@@ -110,15 +477,24 @@ int redis::subscriber::lua_PSubscribe(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
-// https://redis.io/commands/unsubscribe/
-int redis::subscriber::lua_Unsubscribe(GarrysMod::Lua::ILuaBase* LUA)
+int redis::subscriber::Unsubscribe(GarrysMod::Lua::ILuaBase* LUA, bool patterns)
 {
 	subscriber* ptr = GetSubscriber(LUA, 1, true);
-	const char* channel = LUA->CheckString(2);
+	std::vector<std::string> names = GetNames(LUA, 2);
+
+	nameTable& table = patterns ? ptr->m_patterns : ptr->m_channels;
 
 	try
 	{
-		ptr->m_iface.unsubscribe(channel);
+		for (const std::string& name : names)
+		{
+			if (patterns)
+				ptr->m_iface.punsubscribe(name);
+			else
+				ptr->m_iface.unsubscribe(name);
+
+			ptr->Unsubscribed(LUA, ptr->Find(table, name));
+		}
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
@@ -131,23 +507,105 @@ int redis::subscriber::lua_Unsubscribe(GarrysMod::Lua::ILuaBase* LUA)
 	return 1;
 }
 
+// https://redis.io/commands/subscribe/
+// Subscribe(channel or {channel, ...}, callback?, onSubscribed?)
+// callback(self, channel, message) is used instead of OnMessage for these channels,
+// onSubscribed(self, count) runs once every channel is confirmed. All of them go out with the next Commit.
+int redis::subscriber::lua_Subscribe(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return Subscribe(LUA, false);
+}
+
+// https://redis.io/commands/psubscribe/
+// PSubscribe(pattern or {pattern, ...}, callback?, onSubscribed?)
+// callback(self, channel, message, pattern) is used instead of OnMessage for these patterns
+int redis::subscriber::lua_PSubscribe(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return Subscribe(LUA, true);
+}
+
+// https://redis.io/commands/unsubscribe/
+// Unsubscribe(channel or {channel, ...})
+int redis::subscriber::lua_Unsubscribe(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return Unsubscribe(LUA, false);
+}
+
 // https://redis.io/commands/punsubscribe/
+// PUnsubscribe(pattern or {pattern, ...})
 int redis::subscriber::lua_PUnsubscribe(GarrysMod::Lua::ILuaBase* LUA)
+{
+	return Unsubscribe(LUA, true);
+}
+
+// https://redis.io/commands/ssubscribe/
+// SSubscribe(channel or {channel, ...}, callback?)
+// Every channel is subscribed on the cluster node owning its slot over a connection of its own, sent right away.
+// callback(self, channel, message) is used instead of OnMessage for these channels
+int redis::subscriber::lua_SSubscribe(GarrysMod::Lua::ILuaBase* LUA)
 {
 	subscriber* ptr = GetSubscriber(LUA, 1, true);
-	const char* channel = LUA->CheckString(2);
+	std::vector<std::string> names = GetNames(LUA, 2);
+
+	if (LUA->Top() >= 3 && !LUA->IsType(3, GarrysMod::Lua::Type::NIL))
+		LUA->CheckType(3, GarrysMod::Lua::Type::FUNCTION);
+
+	if (ptr->m_host.empty())
+	{
+		LUA->PushNil();
+		LUA->PushString("Not connected");
+		return 2;
+	}
+
+	std::vector<internedName*> interned;
+	interned.reserve(names.size());
+	for (const std::string& name : names)
+		interned.push_back(ptr->Intern(ptr->m_shardChannels, name));
+
+	for (internedName* entry : interned)
+	{
+		SetCallback(LUA, *entry, 3);
+		entry->subscribed = true;
+	}
+
+	if (!ptr->m_shards)
+		ptr->m_shards.reset(new shardRouter(ptr->m_transport, ptr->m_host, ptr->m_port, ptr->m_timeoutMs, [ptr](const std::string& channel, const std::string& message)
+			{
+				ptr->EnqueueMessage(ptr->Acquire(ptr->m_shardChannels, channel), channel, message, nullptr);
+			}, [ptr]
+			{
+				ptr->Wake();
+			}));
 
 	try
 	{
-		ptr->m_iface.punsubscribe(channel);
+		ptr->m_shards->Subscribe(names);
 	}
 	catch (const cpp_redis::redis_error& e)
 	{
+		// The channels stay registered and are subscribed once the cluster can be reached
 		LUA->PushNil();
 		LUA->PushString(e.what());
 		return 2;
 	}
 
+	LUA->PushBool(true);
+	return 1;
+}
+
+// https://redis.io/commands/sunsubscribe/
+// SUnsubscribe(channel or {channel, ...})
+int redis::subscriber::lua_SUnsubscribe(GarrysMod::Lua::ILuaBase* LUA)
+{
+	subscriber* ptr = GetSubscriber(LUA, 1, true);
+	std::vector<std::string> names = GetNames(LUA, 2);
+
+	if (ptr->m_shards)
+		ptr->m_shards->Unsubscribe(names);
+
+	for (const std::string& name : names)
+		ptr->Unsubscribed(LUA, ptr->Find(ptr->m_shardChannels, name));
+
 	LUA->PushBool(true);
 	return 1;
 }
\ No newline at end of file
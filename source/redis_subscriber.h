@@ -1,8 +1,38 @@
 #pragma once
 
+#include "redis_pool.h"
+#include "redis_shards.h"
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+struct internedName;
+typedef std::unordered_map<std::string, std::unique_ptr<internedName>> nameTable;
+
+// A channel or pattern name interned once per subscriber, so messages only carry a pointer to it
+// Queued messages hold on to it, it is freed once it is neither subscribed nor pending
+struct internedName {
+	std::string	name;
+	nameTable*	table;
+	int			reference = 0;	// Lua string, created on the Lua thread when first pushed
+	int			callback = 0;	// Lua thread
+	bool		subscribed = false;	// Lua thread, resubscribed after a reconnect
+	uint32_t	pending = 0;	// Queued messages pointing at it
+	std::list<internedName*>::iterator	idle;	// Channels matched by a pattern, once nothing is pending
+};
+
 struct subActionData {
-	std::string channel;
-	std::string message;
+	internedName*		channel;
+	std::string			message;
+	internedName*		pattern = nullptr;
+	std::string			rawChannel;	// Only set once too many channels are interned
+
+	// Subscription confirmations
+	int32_t				reference = 0;
+	int64_t				count = 0;
 };
 typedef redis::action<subActionData> subAction;
 
@@ -11,12 +41,17 @@ namespace redis
 	class subscriber : BaseInterface<subAction, cpp_redis::subscriber>
 	{
 	public:
-		subscriber(GarrysMod::Lua::ILuaBase* LUA) : BaseInterface(LUA) { }
+		subscriber(GarrysMod::Lua::ILuaBase* LUA) : BaseInterface(LUA, interfaceKind::Subscriber) { }
+		~subscriber();
 
 		static subscriber* GetSubscriber(GarrysMod::Lua::ILuaBase* LUA, int index, bool throwNullError) { return static_cast<subscriber*>(_get(LUA, index, throwNullError)); }
 
 		static void Initialize(GarrysMod::Lua::ILuaBase* LUA);
-		void HandleAction(GarrysMod::Lua::ILuaBase* LUA, subAction action);
+		void HandleAction(GarrysMod::Lua::ILuaBase* LUA, subAction& action);
+		void ReleaseReferences(GarrysMod::Lua::ILuaBase* LUA);
+		bool PollPending(GarrysMod::Lua::ILuaBase* LUA);
+		void ConnectionChanged(GarrysMod::Lua::ILuaBase* LUA, bool connected, const redis::connectionEvent& event);
+		bool NeedsPoll() const { return m_shards && (m_shards->NeedsRefresh() || m_shards->NeedsReroute()); }
 
 		static int lua_Ping(GarrysMod::Lua::ILuaBase* LUA);
 
@@ -24,6 +59,55 @@ namespace redis
 		static int lua_Unsubscribe(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_PSubscribe(GarrysMod::Lua::ILuaBase* LUA);
 		static int lua_PUnsubscribe(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SSubscribe(GarrysMod::Lua::ILuaBase* LUA);
+		static int lua_SUnsubscribe(GarrysMod::Lua::ILuaBase* LUA);
 	private:
+		// Returns the entry for name, creating it if needed
+		internedName* Intern(nameTable& names, const std::string& name);
+		internedName* Find(nameTable& names, const std::string& name);
+
+		// Network thread, for a message about to be queued. Each one is released by HandleAction
+		// nullptr if the name isn't known, or matched too many channels are held, the message then carries the name itself
+		internedName* Acquire(nameTable& names, const std::string& name);
+		internedName* AcquireMatched(const std::string& name);
+		void Release(GarrysMod::Lua::ILuaBase* LUA, internedName* entry);
+
+		// Lua thread, after unsubscribing. Frees the entry unless queued messages still point at it
+		void Unsubscribed(GarrysMod::Lua::ILuaBase* LUA, internedName* entry);
+
+		// Expects m_namesMutex to be held
+		static void Forget(GarrysMod::Lua::ILuaBase* LUA, internedName* entry);
+
+		// Queues a message from the network thread, reusing a pooled buffer for its body
+		void EnqueueMessage(internedName* channel, const std::string& rawChannel, const std::string& message, internedName* pattern);
+
+		static void PushName(GarrysMod::Lua::ILuaBase* LUA, internedName& name);
+
+		// Throws cpp_redis::redis_error
+		void SubscribeName(internedName* entry, bool pattern, const cpp_redis::subscriber::acknowledgement_callback_t& acknowledged);
+
+		static int Subscribe(GarrysMod::Lua::ILuaBase* LUA, bool patterns);
+		static int Unsubscribe(GarrysMod::Lua::ILuaBase* LUA, bool patterns);
+
+		// Replaces the callback registered for a channel or pattern, freeing the old one
+		static void SetCallback(GarrysMod::Lua::ILuaBase* LUA, internedName& name, int stackPos);
+		static void RemoveCallback(GarrysMod::Lua::ILuaBase* LUA, internedName* name);
+
+		std::mutex									m_namesMutex;
+		nameTable									m_channels;
+		nameTable									m_patterns;
+		nameTable									m_shardChannels;
+
+		// Channels matched by patterns, kept while idle so busy ones aren't interned again every message
+		// Idle ones are evicted oldest first once the table is full
+		nameTable									m_matched;
+		std::list<internedName*>					m_idleMatched;
+
+		// Created by the first SSubscribe, against the node given to Connect
+		std::unique_ptr<shardRouter>				m_shards;
+		std::chrono::steady_clock::time_point		m_nextShardRefresh;
+
+		// Message bodies, up to 256 buffers of at most 64 KiB
+		bufferPool<std::string>						m_messagePool{ 256, 64 * 1024 };
 	};
 };
\ No newline at end of file
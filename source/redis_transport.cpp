@@ -0,0 +1,870 @@
+#include "main.hpp"
+#include "redis_transport.h"
+#include "redis_uring.h"
+#include <algorithm>
+#include <cstdlib>
+#include <future>
+#include <unordered_map>
+
+#ifdef REDIS_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+// Matches the read size cpp_redis asks for
+static constexpr size_t readSize = 4096;
+
+// The Connect timeout is meant for the TCP connect, a handshake to a remote host needs longer
+static constexpr uint32_t minHandshakeTimeoutMs = 2000;
+
+// Placeholders are status replies made of this and the frame's sequence number, which Redis never sends
+static constexpr char placeholderMark = '\x1f';
+
+// Frames of commands sent without a callback are never claimed, only this many are kept
+static constexpr size_t maxUnclaimedFrames = 4096;
+
+// Parsed bytes are only dropped from the front of the inbox once there are this many
+static constexpr size_t inboxCompactSize = 64 * 1024;
+
+#ifdef REDIS_TLS
+static std::mutex sessionsMutex;
+static std::unordered_map<std::string, SSL_SESSION*> sessions;
+
+static std::string LastError(const char* fallback)
+{
+	unsigned long code = ERR_get_error();
+	ERR_clear_error();
+	if (code == 0)
+		return fallback;
+
+	char buffer[256];
+	ERR_error_string_n(code, buffer, sizeof(buffer));
+	return buffer;
+}
+
+static bool Retryable(SSL* ssl, int ret)
+{
+	int err = SSL_get_error(ssl, ret);
+	return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+}
+
+// Keeps the newest session, or TLS 1.3 ticket, of every host so reconnects skip the full handshake
+static int OnNewSession(SSL* ssl, SSL_SESSION* session)
+{
+	const std::string* key = static_cast<const std::string*>(SSL_get_app_data(ssl));
+	if (key == nullptr)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(sessionsMutex);
+
+	SSL_SESSION*& cached = sessions[*key];
+	if (cached != nullptr)
+		SSL_SESSION_free(cached);
+
+	cached = session;
+	return 1;
+}
+
+static void ForgetSession(const std::string& key)
+{
+	std::lock_guard<std::mutex> lock(sessionsMutex);
+
+	auto cached = sessions.find(key);
+	if (cached != sessions.end())
+	{
+		SSL_SESSION_free(cached->second);
+		sessions.erase(cached);
+	}
+}
+#endif
+
+redis::transport::transport()
+	: m_tcp(uring::CreateSocket())
+{
+}
+
+redis::transport::transport(std::unique_ptr<cpp_redis::network::tcp_client_iface> tcp)
+	: m_tcp(std::move(tcp))
+{
+}
+
+std::shared_ptr<redis::transport> redis::transport::Sibling()
+{
+	// Anything but tacopie's is a socket on the ring, so its callbacks come from the same thread as this one's
+	bool onRing = dynamic_cast<cpp_redis::network::tcp_client*>(m_tcp.get()) == nullptr;
+	std::shared_ptr<transport> sibling(new transport(onRing ? uring::CreateSocket() : std::unique_ptr<cpp_redis::network::tcp_client_iface>(new cpp_redis::network::tcp_client())));
+
+	bool secure;
+	tlsOptions options;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		secure = m_context != nullptr;
+		options = m_options;
+		sibling->m_auth = m_auth;
+	}
+
+	if (secure)
+		sibling->EnableTLS(options);
+
+	return sibling;
+}
+
+redis::transport::~transport()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Shutdown();
+
+#ifdef REDIS_TLS
+	if (m_context != nullptr)
+		SSL_CTX_free(m_context);
+#endif
+}
+
+void redis::transport::EnableTLS(const tlsOptions& options)
+{
+#ifndef REDIS_TLS
+	throw cpp_redis::redis_error("TLS support was not compiled in");
+#else
+	SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+	if (context == nullptr)
+		throw cpp_redis::redis_error(LastError("Failed to create a TLS context"));
+
+	SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(context, OnNewSession);
+
+	const char* err = nullptr;
+	if (options.verify)
+	{
+		SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+
+		if (options.caFile.empty() ? SSL_CTX_set_default_verify_paths(context) != 1 : SSL_CTX_load_verify_locations(context, options.caFile.c_str(), nullptr) != 1)
+			err = "Failed to load CA certificates";
+	}
+
+	if (err == nullptr && !options.certFile.empty() && SSL_CTX_use_certificate_chain_file(context, options.certFile.c_str()) != 1)
+		err = "Failed to load the client certificate";
+
+	if (err == nullptr && !options.keyFile.empty() && SSL_CTX_use_PrivateKey_file(context, options.keyFile.c_str(), SSL_FILETYPE_PEM) != 1)
+		err = "Failed to load the client key";
+
+	if (err != nullptr)
+	{
+		SSL_CTX_free(context);
+		throw cpp_redis::redis_error(LastError(err));
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Connections already open keep a reference of their own
+	if (m_context != nullptr)
+		SSL_CTX_free(m_context);
+
+	m_context = context;
+	m_options = options;
+#endif
+}
+
+void redis::transport::DisableTLS()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+#ifdef REDIS_TLS
+	if (m_context != nullptr)
+		SSL_CTX_free(m_context);
+#endif
+
+	m_context = nullptr;
+}
+
+void redis::transport::connect(const std::string& addr, std::uint32_t port, std::uint32_t timeout_msecs)
+{
+	m_tcp->connect(addr, port, timeout_msecs);
+
+	StartTLS(addr, port, timeout_msecs);
+	SendPrelude(std::max(timeout_msecs, minHandshakeTimeoutMs));
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_nativeReplies)
+			return;
+
+		m_parsing = true;
+	}
+
+	// With TLS the socket is already read through OnRaw
+	if (!m_secure)
+		ReadRaw();
+}
+
+void redis::transport::StartTLS(const std::string& addr, std::uint32_t port, std::uint32_t timeout_msecs)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	Shutdown();
+
+#ifdef REDIS_TLS
+	if (m_context == nullptr)
+		return;
+
+	m_ssl = SSL_new(m_context);
+	if (m_ssl == nullptr)
+	{
+		std::string err = LastError("Failed to create a TLS connection");
+		lock.unlock();
+		m_tcp->disconnect(true);
+		throw cpp_redis::redis_error(err);
+	}
+
+	SSL_set_bio(m_ssl, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+	SSL_set_connect_state(m_ssl);
+
+	m_sessionKey = addr + ":" + std::to_string(port);
+	SSL_set_app_data(m_ssl, &m_sessionKey);
+
+	{
+		std::lock_guard<std::mutex> sessionLock(sessionsMutex);
+
+		auto cached = sessions.find(m_sessionKey);
+		if (cached != sessions.end())
+			SSL_set_session(m_ssl, cached->second);
+	}
+
+	// IP addresses are checked against the certificate's IP SANs and aren't sent as SNI
+	const std::string& name = m_options.serverName.empty() ? addr : m_options.serverName;
+	bool isAddress = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(m_ssl), name.c_str()) == 1;
+	if (!isAddress)
+	{
+		SSL_set_tlsext_host_name(m_ssl, name.c_str());
+
+		if (m_options.verify)
+			SSL_set1_host(m_ssl, name.c_str());
+	}
+
+	m_handshaking = true;
+	m_error.clear();
+	m_secure = true;
+
+	deliveries_t deliveries;
+	if (!Pump(deliveries) && m_error.empty())
+		m_error = "failed to send the handshake";
+
+	lock.unlock();
+	ReadRaw();
+	lock.lock();
+
+	uint32_t timeoutMs = std::max(timeout_msecs, minHandshakeTimeoutMs);
+	if (!m_handshakeDone.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return !m_handshaking || !m_error.empty(); }))
+		m_error = "TLS handshake timed out";
+
+	if (!m_error.empty())
+	{
+		std::string err = "TLS handshake failed: " + m_error;
+		ForgetSession(m_sessionKey);
+		Shutdown();
+		lock.unlock();
+
+		m_tcp->disconnect(true);
+		throw cpp_redis::redis_error(err);
+	}
+#endif
+}
+
+void redis::transport::SetAuth(const std::vector<std::string>& command)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_auth = command;
+}
+
+void redis::transport::SetDatabase(const std::vector<std::string>& command)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_select = command;
+}
+
+void redis::transport::SetNativeReplies(bool enabled)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_nativeReplies = enabled;
+}
+
+void redis::transport::SetProtocol(int version)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_requestedProtocol = version;
+}
+
+void redis::transport::SetPushHandler(const pushHandler_t& handler)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_onPush = handler;
+}
+
+bool redis::transport::ClaimFrame(const cpp_redis::reply& reply, resp::frame& frame)
+{
+	if (!reply.is_simple_string())
+		return false;
+
+	const std::string& text = reply.as_string();
+	if (text.size() < 2 || text[0] != placeholderMark)
+		return false;
+
+	uint64_t sequence = std::strtoull(text.c_str() + 1, nullptr, 10);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Anything older belonged to a command sent without a callback
+	while (!m_frames.empty() && m_frames.front().first < sequence)
+		m_frames.pop_front();
+
+	if (m_frames.empty() || m_frames.front().first != sequence)
+	{
+		static const char err[] = "Reply was dropped before it was claimed";
+
+		frame.data = err;
+		frame.nodes.assign(1, resp::node{ resp::nodeType::Error, sizeof(err) - 1 });
+		frame.nodes[0].offset = 0;
+		return true;
+	}
+
+	frame = std::move(m_frames.front().second);
+	m_frames.pop_front();
+	return true;
+}
+
+void redis::transport::SendPrelude(std::uint32_t timeoutMs)
+{
+	std::vector<std::vector<std::string>> commands;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (!m_auth.empty())
+			commands.push_back(m_auth);
+
+		// After AUTH, servers with a password refuse HELLO until then
+		if (m_nativeReplies && m_requestedProtocol == 3)
+			commands.push_back({ "HELLO", "3" });
+
+		if (!m_select.empty())
+			commands.push_back(m_select);
+	}
+
+	m_protocol = 2;
+	if (commands.empty())
+		return;
+
+	std::string request;
+	for (const std::vector<std::string>& command : commands)
+	{
+		request.append("*").append(std::to_string(command.size())).append("\r\n");
+		for (const std::string& arg : command)
+			request.append("$").append(std::to_string(arg.size())).append("\r\n").append(arg).append("\r\n");
+	}
+
+	try
+	{
+		write_request write = { std::vector<char>(request.begin(), request.end()), nullptr };
+		Write(write);
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		std::string replies;
+		resp::parser parser;
+		size_t start = 0;
+		for (size_t answered = 0; answered < commands.size(); )
+		{
+			if (start < replies.size() && parser.Parse(replies.data() + start, replies.size() - start))
+			{
+				std::vector<resp::node> nodes;
+				size_t size = parser.Size();
+				parser.Take(nodes);
+
+				const std::string& name = commands[answered++][0];
+				if (nodes[0].type != resp::nodeType::Error)
+				{
+					if (name == "HELLO")
+						m_protocol = 3;
+				}
+				// Servers before Redis 6 don't know HELLO and stay on RESP2
+				else if (name != "HELLO")
+					throw cpp_redis::redis_error(replies.substr(start + nodes[0].offset, nodes[0].size));
+
+				start += size;
+				continue;
+			}
+
+			auto promise = std::make_shared<std::promise<read_result>>();
+			std::future<read_result> future = promise->get_future();
+
+			read_request read = { readSize, [promise](read_result& result)
+				{
+					promise->set_value(std::move(result));
+				} };
+			async_read(read);
+
+			if (future.wait_until(deadline) != std::future_status::ready)
+				throw cpp_redis::redis_error("Timed out restoring AUTH and SELECT");
+
+			read_result result = future.get();
+			if (!result.success)
+				throw cpp_redis::redis_error("Connection lost restoring AUTH and SELECT");
+
+			replies.append(result.buffer.begin(), result.buffer.end());
+		}
+	}
+	catch (const cpp_redis::redis_error&)
+	{
+		disconnect(true);
+		throw;
+	}
+	catch (const std::runtime_error& e)
+	{
+		disconnect(true);
+		throw cpp_redis::redis_error(e.what());
+	}
+}
+
+void redis::transport::disconnect(bool wait_for_removal)
+{
+	m_tcp->disconnect(wait_for_removal);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Shutdown();
+}
+
+bool redis::transport::is_connected() const
+{
+	return m_tcp->is_connected();
+}
+
+void redis::transport::set_nb_workers(std::size_t nb_threads)
+{
+	m_tcp->set_nb_workers(nb_threads);
+}
+
+void redis::transport::set_on_disconnection_handler(const disconnection_handler_t& disconnection_handler)
+{
+	m_onDisconnected = disconnection_handler;
+	m_tcp->set_on_disconnection_handler(disconnection_handler);
+}
+
+void redis::transport::async_read(read_request& request)
+{
+	if (!m_secure && !m_parsing)
+		return m_tcp->async_read(request);
+
+	deliveries_t deliveries;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_reads.push_back(request);
+		Deliver(deliveries);
+	}
+
+	for (auto& delivery : deliveries)
+		delivery.first(delivery.second);
+}
+
+void redis::transport::SetWriteCoalescing(bool enabled)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_coalescing = enabled;
+	}
+
+	if (!enabled)
+		FlushWrites();
+}
+
+void redis::transport::FlushWrites()
+{
+	std::vector<write_request> held;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_heldWrites.empty())
+			return;
+
+		held.swap(m_heldWrites);
+	}
+
+	write_request merged = { std::vector<char>(), nullptr };
+	if (held.size() == 1)
+		merged = std::move(held[0]);
+	else
+	{
+		// tacopie writes a single buffer, so one copy here still saves a syscall for every Commit
+		size_t size = 0;
+		for (const write_request& request : held)
+			size += request.buffer.size();
+
+		merged.buffer.reserve(size);
+		for (const write_request& request : held)
+			merged.buffer.insert(merged.buffer.end(), request.buffer.begin(), request.buffer.end());
+	}
+
+	bool ok = true;
+	try
+	{
+		Write(merged);
+	}
+	catch (const std::exception&)
+	{
+		// Disconnected, tacopie reports it
+		ok = false;
+	}
+
+	if (held.size() > 1)
+		for (write_request& request : held)
+			if (request.async_write_callback)
+			{
+				write_result result = { ok, request.buffer.size() };
+				request.async_write_callback(result);
+			}
+}
+
+void redis::transport::async_write(write_request& request)
+{
+	m_writes++;
+
+	// Unless disconnected, where Write throws so cpp_redis fails the commit's callbacks right away
+	if (m_tcp->is_connected())
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_coalescing)
+		{
+			m_heldWrites.push_back(std::move(request));
+			return;
+		}
+	}
+
+	Write(request);
+}
+
+void redis::transport::Write(write_request& request)
+{
+	if (!m_secure)
+		return m_tcp->async_write(request);
+
+	deliveries_t deliveries;
+	bool ok = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_ssl != nullptr)
+		{
+			m_pendingOut.insert(m_pendingOut.end(), request.buffer.begin(), request.buffer.end());
+			ok = Pump(deliveries);
+		}
+	}
+
+	for (auto& delivery : deliveries)
+		delivery.first(delivery.second);
+
+	if (!ok)
+		Fail();
+
+	if (request.async_write_callback)
+	{
+		write_result result = { ok, request.buffer.size() };
+		request.async_write_callback(result);
+	}
+}
+
+void redis::transport::ReadRaw()
+{
+	read_request request = { readSize, [this](read_result& result)
+		{
+			OnRaw(result);
+		} };
+
+	try
+	{
+		m_tcp->async_read(request);
+	}
+	catch (const std::exception&)
+	{
+		// Disconnected, tacopie reports it
+	}
+}
+
+void redis::transport::OnRaw(read_result& result)
+{
+	deliveries_t deliveries;
+	bool ok = true;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_ssl == nullptr && !m_parsing)
+			return;
+
+		if (!result.success)
+		{
+			for (read_request& request : m_reads)
+				deliveries.emplace_back(request.async_read_callback, read_result{ false, {} });
+
+			m_reads.clear();
+		}
+		else if (m_ssl == nullptr)
+		{
+			ok = Receive(result.buffer.data(), result.buffer.size());
+			Deliver(deliveries);
+		}
+#ifdef REDIS_TLS
+		else
+		{
+			BIO_write(SSL_get_rbio(m_ssl), result.buffer.data(), static_cast<int>(result.buffer.size()));
+			ok = Pump(deliveries);
+		}
+#endif
+	}
+
+	for (auto& delivery : deliveries)
+		delivery.first(delivery.second);
+
+	if (!ok)
+		Fail();
+	else if (result.success)
+		ReadRaw();
+}
+
+void redis::transport::Fail()
+{
+	m_tcp->disconnect(false);
+
+	if (m_onDisconnected)
+		m_onDisconnected();
+}
+
+// RESP2 values go through as they are, RESP3's scalars are rewritten into the RESP2 value closest to them
+static void AppendResp2(std::vector<char>& out, const char* frame, size_t frameSize, const redis::resp::node& value)
+{
+	using redis::resp::nodeType;
+
+	if (frame[0] == '+' || frame[0] == '-' || frame[0] == ':' || frame[0] == '$')
+	{
+		out.insert(out.end(), frame, frame + frameSize);
+		return;
+	}
+
+	std::string converted;
+	switch (value.type)
+	{
+	case nodeType::Null:
+		converted = "$-1\r\n";
+		break;
+
+	case nodeType::Boolean:
+		converted = value.boolean ? ":1\r\n" : ":0\r\n";
+		break;
+
+	case nodeType::Error:
+	{
+		// Blob errors may span lines, simple errors can't
+		std::string text(frame + value.offset, value.size);
+		std::replace(text.begin(), text.end(), '\r', ' ');
+		std::replace(text.begin(), text.end(), '\n', ' ');
+		converted.append("-").append(text).append("\r\n");
+		break;
+	}
+
+	default:
+		converted.append("$").append(std::to_string(value.size)).append("\r\n").append(frame + value.offset, value.size).append("\r\n");
+		break;
+	}
+
+	out.insert(out.end(), converted.begin(), converted.end());
+}
+
+// In RESP3 (un)subscribing is confirmed with a push for every channel, which is the command's reply
+static bool IsConfirmation(const redis::resp::frame& frame)
+{
+	if (frame.nodes.size() < 2 || (frame.nodes[1].type != redis::resp::nodeType::Bulk && frame.nodes[1].type != redis::resp::nodeType::Simple))
+		return false;
+
+	std::string kind = frame.String(frame.nodes[1]);
+	return kind == "subscribe" || kind == "psubscribe" || kind == "ssubscribe" || kind == "unsubscribe" || kind == "punsubscribe" || kind == "sunsubscribe";
+}
+
+bool redis::transport::Receive(const char* data, size_t size)
+{
+	if (!m_parsing)
+	{
+		m_plain.insert(m_plain.end(), data, data + size);
+		return true;
+	}
+
+	m_inbox.append(data, size);
+
+	try
+	{
+		while (m_inboxStart < m_inbox.size() && m_parser.Parse(m_inbox.data() + m_inboxStart, m_inbox.size() - m_inboxStart))
+		{
+			const char* start = m_inbox.data() + m_inboxStart;
+			size_t frameSize = m_parser.Size();
+			m_inboxStart += frameSize;
+
+			resp::frame frame;
+			m_parser.Take(frame.nodes);
+
+			// Scalars are a single allocation for cpp_redis too, so they pass through as they are
+			if (frame.nodes[0].type < resp::nodeType::Array)
+			{
+				AppendResp2(m_plain, start, frameSize, frame.nodes[0]);
+				continue;
+			}
+
+			frame.data.assign(start, frameSize);
+
+			// Pushes aren't replies, cpp_redis never hears of them
+			if (frame.nodes[0].type == resp::nodeType::Push && !IsConfirmation(frame))
+			{
+				if (m_onPush)
+					m_onPush(std::move(frame));
+
+				continue;
+			}
+
+			m_frames.emplace_back(++m_frameSequence, std::move(frame));
+			if (m_frames.size() > maxUnclaimedFrames)
+				m_frames.pop_front();
+
+			std::string placeholder = "+";
+			placeholder.append(1, placeholderMark).append(std::to_string(m_frameSequence)).append("\r\n");
+			m_plain.insert(m_plain.end(), placeholder.begin(), placeholder.end());
+		}
+	}
+	catch (const std::runtime_error&)
+	{
+		return false;
+	}
+
+	if (m_inboxStart == m_inbox.size())
+	{
+		m_inbox.clear();
+		m_inboxStart = 0;
+	}
+	else if (m_inboxStart >= inboxCompactSize)
+	{
+		m_inbox.erase(0, m_inboxStart);
+		m_inboxStart = 0;
+	}
+
+	return true;
+}
+
+bool redis::transport::Pump(deliveries_t& deliveries)
+{
+#ifdef REDIS_TLS
+	if (m_handshaking)
+	{
+		int ret = SSL_do_handshake(m_ssl);
+		if (ret == 1)
+		{
+			m_handshaking = false;
+			m_handshakeDone.notify_all();
+		}
+		else if (!Retryable(m_ssl, ret))
+		{
+			m_error = LastError("connection closed");
+			m_handshakeDone.notify_all();
+			Flush();
+			return false;
+		}
+	}
+
+	if (m_handshaking)
+		return Flush();
+
+	if (!m_pendingOut.empty())
+	{
+		int written = SSL_write(m_ssl, m_pendingOut.data(), static_cast<int>(m_pendingOut.size()));
+		if (written > 0)
+			m_pendingOut.erase(m_pendingOut.begin(), m_pendingOut.begin() + written);
+		else if (!Retryable(m_ssl, written))
+			return false;
+	}
+
+	char buffer[readSize];
+	for (;;)
+	{
+		int read = SSL_read(m_ssl, buffer, sizeof(buffer));
+		if (read <= 0)
+		{
+			if (!Retryable(m_ssl, read))
+				return false;
+
+			break;
+		}
+
+		if (!Receive(buffer, read))
+			return false;
+	}
+
+	Deliver(deliveries);
+	return Flush();
+#else
+	return false;
+#endif
+}
+
+bool redis::transport::Flush()
+{
+#ifdef REDIS_TLS
+	BIO* out = SSL_get_wbio(m_ssl);
+	size_t pending = BIO_ctrl_pending(out);
+	if (pending == 0)
+		return true;
+
+	write_request request = { std::vector<char>(pending), nullptr };
+	BIO_read(out, request.buffer.data(), static_cast<int>(pending));
+
+	try
+	{
+		m_tcp->async_write(request);
+	}
+	catch (const std::exception&)
+	{
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+void redis::transport::Deliver(deliveries_t& deliveries)
+{
+	while (!m_plain.empty() && !m_reads.empty())
+	{
+		read_request request = std::move(m_reads.front());
+		m_reads.pop_front();
+
+		size_t size = std::min(request.size, m_plain.size());
+		deliveries.emplace_back(std::move(request.async_read_callback), read_result{ true, std::vector<char>(m_plain.begin(), m_plain.begin() + size) });
+		m_plain.erase(m_plain.begin(), m_plain.begin() + size);
+	}
+}
+
+void redis::transport::Shutdown()
+{
+#ifdef REDIS_TLS
+	if (m_ssl != nullptr)
+		SSL_free(m_ssl);
+#endif
+
+	m_ssl = nullptr;
+	m_secure = false;
+	m_handshaking = false;
+	m_pendingOut.clear();
+	m_plain.clear();
+	m_reads.clear();
+
+	m_heldWrites.clear();
+
+	m_parsing = false;
+	m_parser.Reset();
+	m_inbox.clear();
+	m_inboxStart = 0;
+	m_frames.clear();
+}
\ No newline at end of file
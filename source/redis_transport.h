@@ -0,0 +1,137 @@
+#pragma once
+
+#include "redis_resp.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+namespace redis
+{
+	struct tlsOptions {
+		std::string	caFile;		// System certificates when empty
+		std::string	certFile;
+		std::string	keyFile;
+		std::string	serverName;	// Defaults to the host given to Connect
+		bool		verify = true;
+	};
+
+	// Sits between cpp_redis and the socket, bytes go straight through unless TLS is enabled
+	// The socket is tacopie's, or io_uring's when that was enabled as the transport was created
+	class transport : public cpp_redis::network::tcp_client_iface
+	{
+	public:
+		// Network thread, with the transport locked
+		typedef std::function<void(resp::frame&& frame)> pushHandler_t;
+
+		transport();
+		~transport();
+
+		// A new transport on the same socket backend, with the same TLS options and AUTH, for connections opened alongside this one
+		// The database isn't carried over, those are cluster connections. Throws cpp_redis::redis_error like EnableTLS
+		std::shared_ptr<transport> Sibling();
+
+		// Both take effect on the next connect, EnableTLS throws cpp_redis::redis_error
+		void EnableTLS(const tlsOptions& options);
+		void DisableTLS();
+
+		// Sent ahead of anything else on every connect, so reconnects come back authenticated and on the same database
+		void SetAuth(const std::vector<std::string>& command);
+		void SetDatabase(const std::vector<std::string>& command);
+
+		// Parses aggregate replies itself instead of leaving them to cpp_redis's builders
+		// cpp_redis gets a one line placeholder for each, which ClaimFrame trades for the parsed frame
+		// Takes effect on the next connect
+		void SetNativeReplies(bool enabled);
+
+		// Network thread, from a reply callback. Returns false if reply isn't a placeholder
+		bool ClaimFrame(const cpp_redis::reply& reply, resp::frame& frame);
+
+		// Asks for RESP3 with HELLO on the next connect, servers without it stay on RESP2
+		// Needs native replies, cpp_redis only ever sees RESP2
+		void SetProtocol(int version);
+		int Protocol() const { return m_protocol; }
+
+		// Holds every write until FlushWrites sends them together, turning it off sends anything held
+		void SetWriteCoalescing(bool enabled);
+		void FlushWrites();
+
+		// Every write cpp_redis made so far, so shutdown can tell whether anything went out after its PING
+		uint64_t Writes() const { return m_writes; }
+
+		// Receives RESP3 push frames, except subscription confirmations which stand in for their command's reply
+		void SetPushHandler(const pushHandler_t& handler);
+
+		void connect(const std::string& addr, std::uint32_t port, std::uint32_t timeout_msecs) override;
+		void disconnect(bool wait_for_removal = false) override;
+		bool is_connected() const override;
+		void set_nb_workers(std::size_t nb_threads) override;
+		void async_read(read_request& request) override;
+		void async_write(write_request& request) override;
+		void set_on_disconnection_handler(const disconnection_handler_t& disconnection_handler) override;
+	private:
+		typedef std::vector<std::pair<async_read_callback_t, read_result>> deliveries_t;
+
+		transport(std::unique_ptr<cpp_redis::network::tcp_client_iface> tcp);
+
+		void Write(write_request& request);
+		void StartTLS(const std::string& addr, std::uint32_t port, std::uint32_t timeout_msecs);
+		void SendPrelude(std::uint32_t timeoutMs);
+
+		void ReadRaw();
+		void OnRaw(read_result& result);
+		void Fail();
+
+		// The rest expect m_mutex to be held
+		// Takes plaintext from the socket or TLS, returns false on a protocol error
+		bool Receive(const char* data, size_t size);
+		bool Pump(deliveries_t& deliveries);
+		bool Flush();
+		void Deliver(deliveries_t& deliveries);
+		void Shutdown();
+
+		std::unique_ptr<cpp_redis::network::tcp_client_iface>	m_tcp;
+		disconnection_handler_t			m_onDisconnected;
+
+		std::mutex						m_mutex;
+		ssl_ctx_st*						m_context = nullptr;
+		tlsOptions						m_options;
+		std::vector<std::string>		m_auth;
+		std::vector<std::string>		m_select;
+
+		// Set while a TLS connection is open
+		std::atomic<bool>				m_secure{ false };
+		ssl_st*							m_ssl = nullptr;
+		std::string						m_sessionKey;	// "host:port", resumable sessions are shared by every transport
+		bool							m_handshaking = false;
+		std::string						m_error;
+		std::condition_variable			m_handshakeDone;
+
+		std::vector<char>				m_pendingOut;	// Plaintext written before the handshake finished
+		std::vector<char>				m_plain;		// Decrypted, waiting for a read request
+		std::deque<read_request>		m_reads;
+
+		std::atomic<uint64_t>			m_writes{ 0 };
+		bool							m_coalescing = false;
+		std::vector<write_request>		m_heldWrites;	// Dropped with their connection, cpp_redis fails their callbacks
+
+		// Set once a connection's prelude is done, reads then go through Receive even without TLS
+		bool							m_nativeReplies = false;
+		int								m_requestedProtocol = 2;
+		std::atomic<int>				m_protocol{ 2 };
+		pushHandler_t					m_onPush;
+		std::atomic<bool>				m_parsing{ false };
+		resp::parser					m_parser;
+		std::string						m_inbox;		// Received from m_inboxStart on, not yet a complete frame
+		size_t							m_inboxStart = 0;
+		uint64_t						m_frameSequence = 0;
+		std::deque<std::pair<uint64_t, resp::frame>>	m_frames;	// Parsed, waiting to be claimed
+	};
+};
\ No newline at end of file
@@ -0,0 +1,924 @@
+#include "main.hpp"
+#include "redis_uring.h"
+#include <atomic>
+
+#ifdef REDIS_IO_URING
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <unordered_set>
+#endif
+
+static std::atomic<bool> enabled{ false };
+
+#ifdef REDIS_IO_URING
+typedef cpp_redis::network::tcp_client_iface socketIface;
+
+// Submission queue entries, shared by every socket
+static constexpr unsigned ringEntries = 256;
+
+// Receive buffers handed to the kernel up front, every socket's multishot receive picks from them
+// Each one goes back as soon as its bytes are copied out
+static constexpr unsigned bufferCount = 256;
+static constexpr unsigned bufferSize = 16 * 1024;
+static constexpr uint16_t bufferGroup = 0;
+
+// Queued writes gathered into one sendmsg
+static constexpr size_t maxSendBuffers = 64;
+
+// user_data of the eventfd read that wakes the ring's thread, operations use their address
+static constexpr uint64_t wakeTag = 1;
+
+namespace redis
+{
+	namespace uring
+	{
+		struct connection {
+			int							fd = -1;
+			std::atomic<bool>			open{ true };
+
+			std::mutex					mutex;
+			bool						receiving = true;	// Until its receive completes for good after closing
+			bool						sending = false;
+			std::vector<char>			received;
+			std::deque<socketIface::read_request>	reads;
+			std::deque<socketIface::write_request>	writes;
+			socketIface::disconnection_handler_t	onDisconnected;
+			std::condition_variable		removed;
+
+			~connection()
+			{
+				if (fd != -1)
+					close(fd);
+			}
+		};
+
+		// Lives from submission until its last completion, which is the ring thread's to handle
+		struct operation {
+			enum class kind { Receive, Send } type;
+			std::shared_ptr<connection>	conn;
+
+			std::vector<socketIface::write_request>	writes;
+			std::vector<iovec>			iov;
+			size_t						firstIov = 0;
+			msghdr						msg{};
+		};
+
+		class ring
+		{
+		public:
+			ring();
+			~ring();
+
+			// Runs fn on the ring's thread before it next submits
+			void Post(std::function<void()>&& fn);
+			bool OnThread() const { return std::this_thread::get_id() == m_thread.get_id(); }
+
+			// Ring thread
+			void Receive(const std::shared_ptr<connection>& conn);
+			void Send(const std::shared_ptr<connection>& conn);
+			void Deliver(const std::shared_ptr<connection>& conn);
+
+			// Any thread, remote reports the disconnect to the socket's handler and fails its pending reads
+			static void Close(const std::shared_ptr<connection>& conn, bool remote);
+		private:
+			void Run();
+			io_uring_sqe* NextSqe();
+			void Enter(unsigned waitFor);
+			void Reap();
+			void ArmWake();
+			void RecycleBuffer(uint16_t id);
+			void SubmitReceive(operation* op);
+			void SubmitSend(operation* op);
+			void OnReceive(operation* op, const io_uring_cqe& cqe);
+			void OnSend(operation* op, const io_uring_cqe& cqe);
+			void Finish(operation* op);
+
+			int							m_fd = -1;
+			void*						m_ringMemory = MAP_FAILED;
+			size_t						m_ringSize = 0;
+			io_uring_sqe*				m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+			size_t						m_sqesSize = 0;
+
+			unsigned*					m_sqHead = nullptr;
+			unsigned*					m_sqTail = nullptr;
+			unsigned*					m_sqArray = nullptr;
+			unsigned					m_sqMask = 0;
+			unsigned					m_sqEntries = 0;
+			unsigned					m_tail = 0;		// Ours, published on Enter
+			unsigned					m_unsubmitted = 0;
+
+			unsigned*					m_cqHead = nullptr;
+			unsigned*					m_cqTail = nullptr;
+			unsigned					m_cqMask = 0;
+			io_uring_cqe*				m_cqes = nullptr;
+
+			io_uring_buf*				m_bufferRing = static_cast<io_uring_buf*>(MAP_FAILED);	// The tail overlays the first entry's resv
+			size_t						m_bufferRingSize = 0;
+			std::unique_ptr<char[]>		m_buffers;
+			uint16_t					m_bufferTail = 0;
+			bool						m_multishot = true;	// Cleared if the kernel turns it down, receives are then re-armed after each completion
+
+			int							m_wakeFd = -1;
+			uint64_t					m_wakeValue = 0;
+
+			std::mutex					m_postMutex;
+			std::vector<std::function<void()>>	m_posted;
+			bool						m_stopping = false;
+
+			std::unordered_set<operation*>	m_live;		// Ring thread, freed with the ring if still in flight
+			std::thread					m_thread;
+		};
+
+		class socket : public socketIface
+		{
+		public:
+			socket(const std::shared_ptr<ring>& owner) : m_ring(owner) { }
+			~socket() { disconnect(true); }
+
+			void connect(const std::string& addr, std::uint32_t port, std::uint32_t timeout_msecs) override;
+			void disconnect(bool wait_for_removal = false) override;
+			bool is_connected() const override;
+			void set_nb_workers(std::size_t nb_threads) override { }
+			void async_read(read_request& request) override;
+			void async_write(write_request& request) override;
+			void set_on_disconnection_handler(const disconnection_handler_t& disconnection_handler) override;
+		private:
+			std::shared_ptr<connection> Current() const;
+
+			std::shared_ptr<ring>		m_ring;
+			disconnection_handler_t		m_onDisconnected;
+
+			mutable std::mutex			m_mutex;
+			std::shared_ptr<connection>	m_conn;
+		};
+	};
+};
+
+static std::mutex ringMutex;
+static std::shared_ptr<redis::uring::ring> sharedRing;
+
+static std::string Describe(const char* what, int err)
+{
+	return std::string(what) + ": " + strerror(err);
+}
+
+// Returns 0 once connected, or the errno it failed with
+static int ConnectWithin(int fd, const sockaddr* address, socklen_t length, uint32_t timeoutMs)
+{
+	if (::connect(fd, address, length) == 0)
+		return 0;
+
+	if (errno != EINPROGRESS)
+		return errno;
+
+	pollfd target = { fd, POLLOUT, 0 };
+
+	int ready;
+	do
+		ready = poll(&target, 1, timeoutMs == 0 ? -1 : static_cast<int>(timeoutMs));
+	while (ready < 0 && errno == EINTR);
+
+	if (ready == 0)
+		return ETIMEDOUT;
+	else if (ready < 0)
+		return errno;
+
+	int err = 0;
+	socklen_t errLength = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLength) != 0)
+		return errno;
+
+	return err;
+}
+
+// Port 0 connects to a unix socket at addr, like tacopie
+static int OpenSocket(const std::string& addr, uint32_t port, uint32_t timeoutMs)
+{
+	if (port == 0)
+	{
+		sockaddr_un address{};
+		if (addr.size() >= sizeof(address.sun_path))
+			throw cpp_redis::redis_error("Unix socket path is too long");
+
+		address.sun_family = AF_UNIX;
+		memcpy(address.sun_path, addr.c_str(), addr.size() + 1);
+
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			throw cpp_redis::redis_error(Describe("Failed to create socket", errno));
+
+		int err = ConnectWithin(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address), timeoutMs);
+		if (err != 0)
+		{
+			close(fd);
+			throw cpp_redis::redis_error(Describe("Failed to connect", err));
+		}
+
+		return fd;
+	}
+
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo* found = nullptr;
+	int status = getaddrinfo(addr.c_str(), std::to_string(port).c_str(), &hints, &found);
+	if (status != 0)
+		throw cpp_redis::redis_error(std::string("Failed to resolve host: ") + gai_strerror(status));
+
+	int err = EADDRNOTAVAIL;
+	for (addrinfo* candidate = found; candidate != nullptr; candidate = candidate->ai_next)
+	{
+		int fd = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, candidate->ai_protocol);
+		if (fd < 0)
+		{
+			err = errno;
+			continue;
+		}
+
+		err = ConnectWithin(fd, candidate->ai_addr, candidate->ai_addrlen, timeoutMs);
+		if (err == 0)
+		{
+			freeaddrinfo(found);
+
+			int noDelay = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+			return fd;
+		}
+
+		close(fd);
+	}
+
+	freeaddrinfo(found);
+	throw cpp_redis::redis_error(Describe("Failed to connect", err));
+}
+
+redis::uring::ring::ring()
+{
+	io_uring_params params{};
+	params.flags = IORING_SETUP_CLAMP;
+
+	m_fd = static_cast<int>(syscall(__NR_io_uring_setup, ringEntries, &params));
+	if (m_fd < 0)
+		throw cpp_redis::redis_error(Describe("io_uring_setup failed", errno));
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_FAST_POLL))
+		throw cpp_redis::redis_error("io_uring needs a newer kernel");
+
+	m_ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	m_ringMemory = mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_ringMemory == MAP_FAILED)
+		throw cpp_redis::redis_error(Describe("Failed to map io_uring", errno));
+
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+	if (m_sqes == MAP_FAILED)
+		throw cpp_redis::redis_error(Describe("Failed to map io_uring", errno));
+
+	char* base = static_cast<char*>(m_ringMemory);
+	m_sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+	m_sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+	m_sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+	m_sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+	m_sqEntries = params.sq_entries;
+	m_tail = *m_sqTail;
+
+	m_cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+	m_cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+	// Registering the buffers once spares every receive from bringing its own
+	m_bufferRingSize = bufferCount * sizeof(io_uring_buf);
+	m_bufferRing = static_cast<io_uring_buf*>(mmap(nullptr, m_bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (m_bufferRing == MAP_FAILED)
+		throw cpp_redis::redis_error(Describe("Failed to map io_uring buffers", errno));
+
+	io_uring_buf_reg registration{};
+	registration.ring_addr = reinterpret_cast<uint64_t>(m_bufferRing);
+	registration.ring_entries = bufferCount;
+	registration.bgid = bufferGroup;
+
+	if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+		throw cpp_redis::redis_error(Describe("io_uring buffer rings need Linux 5.19", errno));
+
+	m_buffers.reset(new char[static_cast<size_t>(bufferCount) * bufferSize]);
+	for (unsigned id = 0; id < bufferCount; id++)
+		RecycleBuffer(static_cast<uint16_t>(id));
+
+	m_wakeFd = eventfd(0, EFD_CLOEXEC);
+	if (m_wakeFd < 0)
+		throw cpp_redis::redis_error(Describe("Failed to create eventfd", errno));
+
+	m_thread = std::thread(&ring::Run, this);
+}
+
+redis::uring::ring::~ring()
+{
+	if (m_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_postMutex);
+			m_stopping = true;
+		}
+
+		uint64_t one = 1;
+		write(m_wakeFd, &one, sizeof(one));
+
+		if (OnThread())
+			m_thread.detach();
+		else
+			m_thread.join();
+	}
+
+	// Closing the ring cancels whatever is still in flight before the operations go
+	if (m_fd != -1)
+		close(m_fd);
+
+	for (operation* op : m_live)
+		delete op;
+
+	if (m_wakeFd != -1)
+		close(m_wakeFd);
+
+	if (m_bufferRing != MAP_FAILED)
+		munmap(m_bufferRing, m_bufferRingSize);
+
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesSize);
+
+	if (m_ringMemory != MAP_FAILED)
+		munmap(m_ringMemory, m_ringSize);
+}
+
+void redis::uring::ring::Post(std::function<void()>&& fn)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_postMutex);
+		if (m_stopping)
+			return;
+
+		m_posted.emplace_back(std::move(fn));
+	}
+
+	// The ring's own thread runs everything posted before it waits again
+	if (!OnThread())
+	{
+		uint64_t one = 1;
+		write(m_wakeFd, &one, sizeof(one));
+	}
+}
+
+void redis::uring::ring::Run()
+{
+	ArmWake();
+
+	std::vector<std::function<void()>> posted;
+	for (;;)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_postMutex);
+			if (m_stopping)
+				return;
+
+			posted.swap(m_posted);
+		}
+
+		for (auto& fn : posted)
+			fn();
+
+		posted.clear();
+
+		bool morePosted;
+		{
+			std::lock_guard<std::mutex> lock(m_postMutex);
+			morePosted = !m_posted.empty();
+		}
+
+		// Everything queued since the last wait, across every socket, goes in with this one call
+		Enter(morePosted ? 0 : 1);
+		Reap();
+	}
+}
+
+io_uring_sqe* redis::uring::ring::NextSqe()
+{
+	// Full only with completions backed up, submitting frees the space once they're reaped
+	while (m_tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+	{
+		Enter(0);
+		if (m_tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+			Reap();
+	}
+
+	unsigned index = m_tail & m_sqMask;
+	io_uring_sqe* sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	m_sqArray[index] = index;
+	m_tail++;
+	m_unsubmitted++;
+
+	return sqe;
+}
+
+void redis::uring::ring::Enter(unsigned waitFor)
+{
+	__atomic_store_n(m_sqTail, m_tail, __ATOMIC_RELEASE);
+
+	for (;;)
+	{
+		long submitted = syscall(__NR_io_uring_enter, m_fd, m_unsubmitted, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if (submitted >= 0)
+		{
+			m_unsubmitted -= static_cast<unsigned>(submitted);
+			return;
+		}
+
+		// EBUSY and EAGAIN clear up once completions are reaped, the loop comes back here right after
+		if (errno != EINTR)
+			return;
+	}
+}
+
+void redis::uring::ring::Reap()
+{
+	// The head is read again every time, handlers can reap from NextSqe when the queue is full
+	for (;;)
+	{
+		unsigned head = *m_cqHead;
+		unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		// Copied out so the slot can be handed back before the handlers run
+		io_uring_cqe cqe = m_cqes[head & m_cqMask];
+		__atomic_store_n(m_cqHead, ++head, __ATOMIC_RELEASE);
+
+		if (cqe.user_data == wakeTag)
+		{
+			ArmWake();
+			continue;
+		}
+
+		operation* op = reinterpret_cast<operation*>(cqe.user_data);
+		if (op->type == operation::kind::Receive)
+			OnReceive(op, cqe);
+		else
+			OnSend(op, cqe);
+	}
+}
+
+void redis::uring::ring::ArmWake()
+{
+	io_uring_sqe* sqe = NextSqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = m_wakeFd;
+	sqe->addr = reinterpret_cast<uint64_t>(&m_wakeValue);
+	sqe->len = sizeof(m_wakeValue);
+	sqe->user_data = wakeTag;
+}
+
+void redis::uring::ring::RecycleBuffer(uint16_t id)
+{
+	// io_uring_buf_ring's flexible array is offset in C++, so the entries are indexed directly
+	io_uring_buf* buffer = &m_bufferRing[m_bufferTail & (bufferCount - 1)];
+	buffer->addr = reinterpret_cast<uint64_t>(m_buffers.get() + static_cast<size_t>(id) * bufferSize);
+	buffer->len = bufferSize;
+	buffer->bid = id;
+
+	__atomic_store_n(&m_bufferRing[0].resv, ++m_bufferTail, __ATOMIC_RELEASE);
+}
+
+void redis::uring::ring::Close(const std::shared_ptr<connection>& conn, bool remote)
+{
+	std::deque<socketIface::read_request> failed;
+	socketIface::disconnection_handler_t handler;
+
+	{
+		std::lock_guard<std::mutex> lock(conn->mutex);
+		if (!conn->open)
+			return;
+
+		conn->open = false;
+		conn->received.clear();
+		conn->writes.clear();
+
+		if (remote)
+		{
+			failed.swap(conn->reads);
+			handler = conn->onDisconnected;
+		}
+		else
+			conn->reads.clear();
+	}
+
+	// Ends the receive and any send in flight, the descriptor closes with the last of them
+	shutdown(conn->fd, SHUT_RDWR);
+
+	for (auto& request : failed)
+	{
+		if (!request.async_read_callback)
+			continue;
+
+		socketIface::read_result result = { false, {} };
+		request.async_read_callback(result);
+	}
+
+	if (handler)
+		handler();
+}
+
+void redis::uring::ring::Receive(const std::shared_ptr<connection>& conn)
+{
+	operation* op = new operation{ operation::kind::Receive, conn };
+	m_live.insert(op);
+
+	SubmitReceive(op);
+}
+
+void redis::uring::ring::SubmitReceive(operation* op)
+{
+	// A receive armed after Close's shutdown completes straight away with 0
+	if (!op->conn->open)
+		return Finish(op);
+
+	io_uring_sqe* sqe = NextSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = op->conn->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bufferGroup;
+	sqe->ioprio = m_multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = reinterpret_cast<uint64_t>(op);
+}
+
+void redis::uring::ring::OnReceive(operation* op, const io_uring_cqe& cqe)
+{
+	bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+	if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+	{
+		uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		const char* data = m_buffers.get() + static_cast<size_t>(id) * bufferSize;
+
+		{
+			std::lock_guard<std::mutex> lock(op->conn->mutex);
+			if (op->conn->open)
+				op->conn->received.insert(op->conn->received.end(), data, data + cqe.res);
+		}
+
+		RecycleBuffer(id);
+		Deliver(op->conn);
+
+		if (!more)
+			SubmitReceive(op);
+
+		return;
+	}
+
+	if (more)
+		return;
+
+	// Every buffer was taken, they are all back by now
+	if (cqe.res == -ENOBUFS)
+		return SubmitReceive(op);
+
+	// Kernels before 6.0 know provided buffers but not multishot receives
+	if (cqe.res == -EINVAL && m_multishot)
+	{
+		m_multishot = false;
+		return SubmitReceive(op);
+	}
+
+	Close(op->conn, true);
+	Finish(op);
+}
+
+void redis::uring::ring::Finish(operation* op)
+{
+	if (op->type == operation::kind::Receive)
+	{
+		std::lock_guard<std::mutex> lock(op->conn->mutex);
+		op->conn->receiving = false;
+		op->conn->removed.notify_all();
+	}
+
+	m_live.erase(op);
+	delete op;
+}
+
+void redis::uring::ring::Deliver(const std::shared_ptr<connection>& conn)
+{
+	std::vector<std::pair<socketIface::async_read_callback_t, socketIface::read_result>> deliveries;
+
+	{
+		std::lock_guard<std::mutex> lock(conn->mutex);
+		while (!conn->reads.empty() && !conn->received.empty())
+		{
+			socketIface::read_request request = std::move(conn->reads.front());
+			conn->reads.pop_front();
+
+			socketIface::read_result result = { true, {} };
+			if (request.size >= conn->received.size())
+				result.buffer.swap(conn->received);
+			else
+			{
+				result.buffer.assign(conn->received.begin(), conn->received.begin() + request.size);
+				conn->received.erase(conn->received.begin(), conn->received.begin() + request.size);
+			}
+
+			deliveries.emplace_back(std::move(request.async_read_callback), std::move(result));
+		}
+	}
+
+	for (auto& delivery : deliveries)
+	{
+		if (delivery.first)
+			delivery.first(delivery.second);
+	}
+}
+
+void redis::uring::ring::Send(const std::shared_ptr<connection>& conn)
+{
+	operation* op = new operation{ operation::kind::Send, conn };
+
+	{
+		std::lock_guard<std::mutex> lock(conn->mutex);
+		if (!conn->open || conn->writes.empty())
+		{
+			conn->sending = false;
+			delete op;
+			return;
+		}
+
+		// Everything queued since the last send goes out as one sendmsg
+		while (!conn->writes.empty() && op->writes.size() < maxSendBuffers)
+		{
+			op->writes.emplace_back(std::move(conn->writes.front()));
+			conn->writes.pop_front();
+		}
+	}
+
+	op->iov.reserve(op->writes.size());
+	for (auto& request : op->writes)
+		op->iov.push_back({ request.buffer.data(), request.buffer.size() });
+
+	m_live.insert(op);
+	SubmitSend(op);
+}
+
+void redis::uring::ring::SubmitSend(operation* op)
+{
+	op->msg.msg_iov = op->iov.data() + op->firstIov;
+	op->msg.msg_iovlen = op->iov.size() - op->firstIov;
+
+	io_uring_sqe* sqe = NextSqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = op->conn->fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&op->msg);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = reinterpret_cast<uint64_t>(op);
+}
+
+void redis::uring::ring::OnSend(operation* op, const io_uring_cqe& cqe)
+{
+	std::shared_ptr<connection> conn = op->conn;
+	bool sent = cqe.res >= 0;
+
+	if (sent)
+	{
+		// A short send picks up from where it stopped
+		size_t remaining = static_cast<size_t>(cqe.res);
+		while (op->firstIov < op->iov.size() && (remaining > 0 || op->iov[op->firstIov].iov_len == 0))
+		{
+			iovec& vec = op->iov[op->firstIov];
+			if (remaining < vec.iov_len)
+			{
+				vec.iov_base = static_cast<char*>(vec.iov_base) + remaining;
+				vec.iov_len -= remaining;
+				break;
+			}
+
+			remaining -= vec.iov_len;
+			op->firstIov++;
+		}
+
+		if (op->firstIov < op->iov.size())
+		{
+			if (cqe.res > 0 && conn->open)
+				return SubmitSend(op);
+
+			sent = false;
+		}
+	}
+
+	std::vector<socketIface::write_request> writes = std::move(op->writes);
+	m_live.erase(op);
+	delete op;
+
+	if (!sent)
+	{
+		{
+			std::lock_guard<std::mutex> lock(conn->mutex);
+			conn->sending = false;
+		}
+
+		Close(conn, true);
+	}
+
+	for (auto& request : writes)
+	{
+		if (!request.async_write_callback)
+			continue;
+
+		socketIface::write_result result = { sent, sent ? request.buffer.size() : 0 };
+		request.async_write_callback(result);
+	}
+
+	if (sent)
+		Send(conn);
+}
+
+std::shared_ptr<redis::uring::connection> redis::uring::socket::Current() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_conn;
+}
+
+void redis::uring::socket::connect(const std::string& addr, std::uint32_t port, std::uint32_t timeout_msecs)
+{
+	if (is_connected())
+		throw cpp_redis::redis_error("Already connected");
+
+	std::shared_ptr<connection> conn = std::make_shared<connection>();
+	conn->fd = OpenSocket(addr, port, timeout_msecs);
+	conn->onDisconnected = m_onDisconnected;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_conn = conn;
+	}
+
+	ring* owner = m_ring.get();
+	m_ring->Post([owner, conn]() { owner->Receive(conn); });
+}
+
+void redis::uring::socket::disconnect(bool wait_for_removal)
+{
+	std::shared_ptr<connection> conn;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		conn.swap(m_conn);
+	}
+
+	if (!conn)
+		return;
+
+	ring::Close(conn, false);
+
+	// From a callback the ring's thread can't wait on itself
+	if (wait_for_removal && !m_ring->OnThread())
+	{
+		std::unique_lock<std::mutex> lock(conn->mutex);
+		conn->removed.wait(lock, [&conn]() { return !conn->receiving; });
+	}
+}
+
+bool redis::uring::socket::is_connected() const
+{
+	std::shared_ptr<connection> conn = Current();
+	return conn && conn->open;
+}
+
+void redis::uring::socket::async_read(read_request& request)
+{
+	std::shared_ptr<connection> conn = Current();
+	if (!conn)
+		return;
+
+	bool ready;
+	{
+		std::lock_guard<std::mutex> lock(conn->mutex);
+		if (!conn->open)
+			return;
+
+		conn->reads.push_back(request);
+		ready = !conn->received.empty();
+	}
+
+	if (!ready)
+		return;
+
+	// Reads chained from a read callback are answered from the ring's loop rather than recursing
+	if (m_ring->OnThread())
+	{
+		ring* owner = m_ring.get();
+		m_ring->Post([owner, conn]() { owner->Deliver(conn); });
+	}
+	else
+		m_ring->Deliver(conn);
+}
+
+void redis::uring::socket::async_write(write_request& request)
+{
+	std::shared_ptr<connection> conn = Current();
+	if (!conn)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(conn->mutex);
+		if (!conn->open)
+			return;
+
+		conn->writes.push_back(request);
+		if (conn->sending)
+			return;
+
+		conn->sending = true;
+	}
+
+	ring* owner = m_ring.get();
+	m_ring->Post([owner, conn]() { owner->Send(conn); });
+}
+
+void redis::uring::socket::set_on_disconnection_handler(const disconnection_handler_t& disconnection_handler)
+{
+	m_onDisconnected = disconnection_handler;
+
+	std::shared_ptr<connection> conn = Current();
+	if (conn)
+	{
+		std::lock_guard<std::mutex> lock(conn->mutex);
+		conn->onDisconnected = disconnection_handler;
+	}
+}
+
+void redis::uring::SetEnabled(bool enable)
+{
+	if (enable)
+	{
+		std::lock_guard<std::mutex> lock(ringMutex);
+		if (!sharedRing)
+			sharedRing = std::make_shared<ring>();
+	}
+
+	enabled = enable;
+}
+
+std::unique_ptr<cpp_redis::network::tcp_client_iface> redis::uring::CreateSocket()
+{
+	if (enabled)
+	{
+		std::lock_guard<std::mutex> lock(ringMutex);
+		if (sharedRing)
+			return std::unique_ptr<cpp_redis::network::tcp_client_iface>(new socket(sharedRing));
+	}
+
+	return std::unique_ptr<cpp_redis::network::tcp_client_iface>(new cpp_redis::network::tcp_client());
+}
+
+void redis::uring::Shutdown()
+{
+	enabled = false;
+
+	std::lock_guard<std::mutex> lock(ringMutex);
+	sharedRing.reset();
+}
+#else
+void redis::uring::SetEnabled(bool enable)
+{
+	if (enable)
+		throw cpp_redis::redis_error("Module was built without io_uring support");
+}
+
+std::unique_ptr<cpp_redis::network::tcp_client_iface> redis::uring::CreateSocket()
+{
+	return std::unique_ptr<cpp_redis::network::tcp_client_iface>(new cpp_redis::network::tcp_client());
+}
+
+void redis::uring::Shutdown()
+{
+}
+#endif
+
+bool redis::uring::Enabled()
+{
+	return enabled;
+}
\ No newline at end of file
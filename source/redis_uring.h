@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+
+namespace redis
+{
+	// An io_uring backend for the sockets under the transport, Linux only and built with REDIS_IO_URING
+	// Every socket shares one ring and its thread, which submits the sends and receives of all of them in one io_uring_enter
+	namespace uring
+	{
+		// Sockets created while enabled use the ring, enabling throws cpp_redis::redis_error if the kernel can't set it up
+		void SetEnabled(bool enabled);
+		bool Enabled();
+
+		// A socket on the ring when enabled, tacopie's otherwise
+		std::unique_ptr<cpp_redis::network::tcp_client_iface> CreateSocket();
+
+		// Lets the ring's thread stop once the last socket using it is gone
+		void Shutdown();
+	};
+};
\ No newline at end of file